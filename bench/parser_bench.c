@@ -0,0 +1,175 @@
+/*
+ * Response parser benchmark and scanner self-check.
+ *
+ * Feeds canned responses to the incremental parser split into 16 KiB,
+ * 1460 B (one TCP segment) and 64 B reads and reports MB/s for each
+ * scanner level the CPU has. Then runs every SIMD scanner against the
+ * scalar one on random input and fails on the first difference.
+ *
+ * Built with the library source so the internal parser is reachable:
+ *   make bench && ./bin/parser_bench [iterations] [random inputs]
+ */
+#include "libhttp.c"
+
+#define BENCH_MAX_RESPONSE (1 << 20)
+
+static double bench_now(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+// A response of about header_size bytes of fields, chunked or with a Content-Length body
+static size_t bench_response(char *r, size_t header_size, size_t body_len, int chunked)
+{
+    size_t n = sprintf(r, "HTTP/1.1 200 OK\r\nContent-Type: application/json\r\nServer: bench\r\n");
+    for (int i = 0; n < header_size; i++)
+        n += sprintf(r + n, "X-Api-Header-%d: value-%08x-some-longer-text-to-fill\r\n", i, i * 2654435761u);
+    if (!chunked)
+    {
+        n += sprintf(r + n, "Content-Length: %zu\r\n\r\n", body_len);
+        memset(r + n, 'b', body_len);
+        return n + body_len;
+    }
+    n += sprintf(r + n, "Transfer-Encoding: chunked\r\n\r\n");
+    for (size_t left = body_len; left;)
+    {
+        size_t c = left < 4096 ? left : 4096;
+        n += sprintf(r + n, "%zx;ext=1\r\n", c);
+        memset(r + n, 'b', c);
+        n += c;
+        n += sprintf(r + n, "\r\n");
+        left -= c;
+    }
+    return n + sprintf(r + n, "0\r\nX-Trailer: 1\r\n\r\n");
+}
+
+// Parse the response iterations times in split byte reads, -1 on a parse error
+static double bench_parse(http_session http, const char *r, size_t n, size_t split, int iterations, size_t body_len)
+{
+    double start = bench_now();
+    for (int k = 0; k < iterations; k++)
+    {
+        struct http_parser p;
+        __response_body_reset(http);
+        __parser_init(&p, 0);
+        for (size_t off = 0; off < n && p.state != HTTP_PARSE_DONE;)
+        {
+            long used = __parser_feed(http, &p, r + off, n - off < split ? n - off : split);
+            if (used < 0)
+            {
+                __parser_free(&p);
+                return -1;
+            }
+            off += used;
+            p.head_done = 0;
+        }
+        __parser_free(&p);
+        if (p.state != HTTP_PARSE_DONE || http->response.body_len != body_len)
+            return -1;
+    }
+    return (double)n * iterations / (bench_now() - start) / 1e6;
+}
+
+// Random bytes leaning towards the characters the scanners stop on
+static void bench_random(char *s, size_t len, unsigned *seed)
+{
+    static const char common[] = "\n\r :;\t-_0123456789abcdefABCDEFxyzXYZ\"(),/\x7f\x80\xff";
+    for (size_t i = 0; i < len; i++)
+    {
+        *seed = *seed * 1103515245u + 12345u;
+        unsigned v = *seed >> 8;
+        s[i] = v & 1 ? common[(v >> 1) % (sizeof(common) - 1)] : (char)(v >> 1);
+    }
+}
+
+// Every scanner level gives the scalar answer on random input
+static int bench_check(int levels, long inputs)
+{
+    static const unsigned char *classes[] = {__token_class, __hex_class};
+    char buf[512];
+    unsigned seed = 2463534242u;
+    for (long k = 0; k < inputs; k++)
+    {
+        size_t off = k % 32, len = (seed >> 4) % (sizeof(buf) - 32);
+        bench_random(buf, sizeof(buf), &seed);
+        // Long runs of one class so the vector loops are exercised too
+        if (k % 3 == 0)
+            memset(buf + off, k % 2 ? 'a' : '7', len / 2);
+
+        __simd_cpu = HTTP_SIMD_NONE;
+        size_t lf = __scan_lf(buf + off, len), span[2];
+        for (int c = 0; c < 2; c++)
+            span[c] = __span_class(buf + off, len, classes[c]);
+        for (int level = HTTP_SIMD_SSE42; level <= levels; level++)
+        {
+            __simd_cpu = level;
+            int bad = __scan_lf(buf + off, len) != lf;
+            for (int c = 0; c < 2; c++)
+                bad |= __span_class(buf + off, len, classes[c]) != span[c];
+            if (bad)
+            {
+                fprintf(stderr, "scanner level %d differs from scalar on input %ld (offset %zu, length %zu)\n",
+                        level, k, off, len);
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    static const char *level_names[] = {"scalar", "sse4.2", "avx2"};
+    static const size_t splits[] = {16384, 1460, 64};
+    static const struct
+    {
+        const char *name;
+        size_t header_size;
+        size_t body_len;
+        int chunked;
+    } cases[] = {
+        {"1 KiB headers, 1 KiB body", 1024, 1024, 0},
+        {"8 KiB headers, no body", 8192, 0, 0},
+        {"chunked 64 KiB body", 512, 65536, 1},
+    };
+    int iterations = argc > 1 ? atoi(argv[1]) : 5000;
+    long inputs = argc > 2 ? atol(argv[2]) : 300000;
+
+    int levels = __simd_level();
+    char *r = (char *)malloc(BENCH_MAX_RESPONSE);
+    http_session http = http_new();
+    if (!r || !http)
+        return 1;
+
+    for (size_t c = 0; c < sizeof(cases) / sizeof(cases[0]); c++)
+    {
+        size_t n = bench_response(r, cases[c].header_size, cases[c].body_len, cases[c].chunked);
+        printf("%s (%zu bytes)\n", cases[c].name, n);
+        for (size_t s = 0; s < sizeof(splits) / sizeof(splits[0]); s++)
+        {
+            printf("  %5zu B reads:", splits[s]);
+            for (int level = HTTP_SIMD_NONE; level <= levels; level++)
+            {
+                __simd_cpu = level;
+                double mbs = bench_parse(http, r, n, splits[s], iterations, cases[c].body_len);
+                if (mbs < 0)
+                {
+                    printf("\nparse error: %s\n", http_get_error(http));
+                    return 1;
+                }
+                printf("  %s %7.0f MB/s", level_names[level], mbs);
+            }
+            printf("\n");
+        }
+    }
+
+    int ret = bench_check(levels, inputs);
+    if (!ret)
+        printf("scanners up to %s match scalar on %ld random inputs\n", level_names[levels], inputs);
+    __simd_cpu = levels;
+    http_free(http);
+    free(r);
+    return ret;
+}
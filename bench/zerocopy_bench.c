@@ -0,0 +1,184 @@
+/*
+ * MSG_ZEROCOPY send benchmark (Linux).
+ *
+ * PUTs an in-memory body set with http_options_set_body_ref to a sink
+ * thread on loopback, once with send() and once with MSG_ZEROCOPY, over
+ * one keep-alive connection each. Reports the sending thread's CPU time
+ * and the wall time per GiB. The sink only counts the body bytes and
+ * replies with the count, which is checked against the body size.
+ *
+ * Loopback copies the pages on delivery, so only the client CPU column
+ * says anything about a real NIC:
+ *   make bench && ./bin/zerocopy_bench [MiB per request] [requests]
+ */
+#define _GNU_SOURCE
+#include "libhttp.h"
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#define BENCH_SINK_BUFFER (1 << 20)
+
+static double bench_now(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+// User and system time of the calling thread, the sink runs on its own
+static double bench_thread_cpu(void)
+{
+    struct rusage ru;
+    getrusage(RUSAGE_THREAD, &ru);
+    return ru.ru_utime.tv_sec + ru.ru_stime.tv_sec +
+           (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) / 1e6;
+}
+
+/**
+ * Serve one connection: read each request's headers, discard
+ * Content-Length bytes of body and reply with the number of bytes read
+ */
+static void *bench_sink(void *arg)
+{
+    int listener = *(int *)arg;
+    int fd = accept(listener, NULL, NULL);
+    char *buf = (char *)malloc(BENCH_SINK_BUFFER + 1);
+    size_t have = 0;
+
+    while (fd >= 0 && buf)
+    {
+        char *end;
+        buf[have] = 0;
+        while (!(end = strstr(buf, "\r\n\r\n")))
+        {
+            long n = recv(fd, buf + have, BENCH_SINK_BUFFER - have, 0);
+            if (n <= 0)
+                goto done;
+            have += n;
+            buf[have] = 0;
+        }
+        end += 4;
+
+        char *cl = strcasestr(buf, "\r\nContent-Length:");
+        long long want = cl && cl < end ? atoll(cl + 17) : 0;
+        size_t extra = have - (end - buf);
+        long long got = extra < (unsigned long long)want ? (long long)extra : want;
+        // Keep whatever followed the body for the next request
+        memmove(buf, end + got, extra - got);
+        have = extra - got;
+        while (got < want)
+        {
+            size_t room = want - got < BENCH_SINK_BUFFER ? want - got : BENCH_SINK_BUFFER;
+            long n = recv(fd, buf, room, 0);
+            if (n <= 0)
+                goto done;
+            got += n;
+        }
+
+        char reply[96];
+        char count[24];
+        int count_len = sprintf(count, "%lld", got);
+        int len = sprintf(reply, "HTTP/1.1 200 OK\r\nContent-Length: %d\r\n\r\n%s", count_len, count);
+        if (send(fd, reply, len, MSG_NOSIGNAL) != len)
+            break;
+    }
+done:
+    free(buf);
+    if (fd >= 0)
+        close(fd);
+    return NULL;
+}
+
+// Send requests PUTs of size bytes, -1 on failure
+static int bench_run(int port, const char *body, size_t size, int requests, int zerocopy)
+{
+    char url[64];
+    long method = HTTP_PUT;
+    long mode = zerocopy ? HTTP_ZEROCOPY_ENABLE : HTTP_ZEROCOPY_DISABLE;
+    int ret = -1;
+
+    sprintf(url, "http://127.0.0.1:%d/sink", port);
+    http_session http = http_new();
+    if (!http)
+        return -1;
+    http_options_set(http, HTTP_OPTIONS_URL, url);
+    http_options_set(http, HTTP_OPTIONS_REQUEST_METHOD, &method);
+    http_options_set(http, HTTP_OPTIONS_CONNECTION_HEADER, "keep-alive");
+    http_options_set(http, HTTP_OPTIONS_ZEROCOPY, &mode);
+    http_options_set_body_ref(http, HTTP_OPTIONS_PUT_BODY, body, size);
+
+    if (http_connect(http) != HTTP_OK)
+    {
+        fprintf(stderr, "connect failed: %s\n", http_get_error(http));
+        http_free(http);
+        return -1;
+    }
+    double cpu = bench_thread_cpu(), start = bench_now();
+    for (int i = 0; i < requests; i++)
+    {
+        if (http_session_start(http) != HTTP_OK)
+            goto out;
+        if (strtoull(http_get_body(http), NULL, 10) != size)
+        {
+            fprintf(stderr, "sink received %s of %zu bytes\n", http_get_body(http), size);
+            goto out;
+        }
+    }
+    double gib = (double)size * requests / (1 << 30);
+    cpu = bench_thread_cpu() - cpu;
+    printf("  %-13s %6.3f s client CPU/GiB  %6.3f s wall/GiB\n", zerocopy ? "MSG_ZEROCOPY" : "send()",
+           cpu / gib, (bench_now() - start) / gib);
+    ret = 0;
+out:
+    if (ret)
+        fprintf(stderr, "request failed: %s\n", http_get_error(http));
+    http_disconnect(http);
+    http_free(http);
+    return ret;
+}
+
+int main(int argc, char **argv)
+{
+    size_t size = (size_t)(argc > 1 ? atol(argv[1]) : 256) << 20;
+    int requests = argc > 2 ? atoi(argv[2]) : 4;
+    char *body = (char *)malloc(size);
+    if (!body || requests < 1)
+        return 1;
+    memset(body, 'x', size);
+
+    printf("%d x %zu MiB PUTs over loopback:\n", requests, size >> 20);
+    for (int zerocopy = 0; zerocopy < 2; zerocopy++)
+    {
+        struct sockaddr_in addr = {0};
+        socklen_t addr_len = sizeof(addr);
+        pthread_t sink;
+        int listener = socket(AF_INET, SOCK_STREAM, 0);
+
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        if (listener < 0 || bind(listener, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+            listen(listener, 1) != 0 || getsockname(listener, (struct sockaddr *)&addr, &addr_len) != 0 ||
+            pthread_create(&sink, NULL, bench_sink, &listener) != 0)
+        {
+            perror("sink");
+            return 1;
+        }
+        int ret = bench_run(ntohs(addr.sin_port), body, size, requests, zerocopy);
+        // Wakes the sink up if the client never connected
+        shutdown(listener, SHUT_RDWR);
+        pthread_join(sink, NULL);
+        close(listener);
+        if (ret)
+            return 1;
+    }
+    free(body);
+    return 0;
+}
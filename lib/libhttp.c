@@ -5,24 +5,82 @@
 #include <errno.h>
 #include <stdarg.h>
 #include <time.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#if defined(_WIN32)
+#include <io.h>
+#endif
+#if defined(__linux__)
+#include <sys/sendfile.h>
+#endif
+#if !defined(_WIN32)
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <pthread.h>
+#define HTTP_HAVE_READAHEAD 1
+#endif
+#if defined(__linux__) && defined(MSG_ZEROCOPY) && defined(SO_ZEROCOPY)
+#include <poll.h>
+#include <linux/errqueue.h>
+#define HTTP_HAVE_ZEROCOPY 1
+#endif
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define HTTP_HAVE_SIMD_X86 1
+#endif
 
 #include <openssl/crypto.h>
 #include <openssl/x509.h>
 #include <openssl/ssl.h>
 #include <openssl/err.h>
+#include <openssl/rand.h>
+#include <zlib.h>
+#ifdef LIBHTTP_WITH_ZSTD
+#include <zstd.h>
+#endif
 
 #if defined(_WIN32)
 #define IsValidSocket(s) ((s) != INVALID_SOCKET)
 #define CloseSocket(s) closesocket(s)
+#define SHUT_RDWR SD_BOTH
 #else
 #define IsValidSocket(s) ((s) >= 0)
 #define CloseSocket(s) close(s)
 #endif /* _WIN32 */
 
+/* Reference counts of options shared between cloned sessions */
+#if defined(_MSC_VER)
+#define __refs_inc(p) InterlockedIncrement((volatile long *)(p))
+#define __refs_dec(p) InterlockedDecrement((volatile long *)(p))
+#define __refs_get(p) InterlockedCompareExchange((volatile long *)(p), 0, 0)
+#else
+#define __refs_inc(p) __atomic_add_fetch((p), 1, __ATOMIC_ACQ_REL)
+#define __refs_dec(p) __atomic_sub_fetch((p), 1, __ATOMIC_ACQ_REL)
+#define __refs_get(p) __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#endif
+
 #define MAXREQUEST 4097
 #define MAXBUFFER 2048
-#define MAXRESPONSE 98567
 #define RES_TIMEOUT 6.0
+#define HTTP_PREPARED_MAX_SLOTS 4
+#define HTTP_PREPARED_SLACK 256
+#define HTTP_STREAM_CHUNK 65536
+#define HTTP_COALESCE_MAX 16384
+#define HTTP_CONTINUE_TIMEOUT 1000
+#define HTTP_RECV_BUFFER 16384
+#define HTTP_MAX_RESPONSE_HEADERS (1 << 20)
+#define HTTP_BODY_CHUNK_MIN 4096
+#define HTTP_BODY_CHUNK_MAX (1 << 20)
+#define HTTP_BODY_POOL_MAX (256 << 10)
+#define HTTP_ZEROCOPY_MIN 65536
+#define HTTP_MMAP_WINDOW (8 << 20)
+#define HTTP_READ_AHEAD_MAX 16
+
+#define __LIBHTTP_STR(x) #x
+#define LIBHTTP_STR(x) __LIBHTTP_STR(x)
+#define LIBHTTP_USER_AGENT "libhttp(nshell)/" LIBHTTP_STR(LIBHTTP_VERSION_MINOR) "." \
+    LIBHTTP_STR(LIBHTTP_VERSION_MAJOR) "." LIBHTTP_STR(LIBHTTP_VERSION_MACRO)
 
 enum response_state
 {
@@ -46,6 +104,55 @@ struct http_proxy
     int http_send_request_flag;
 };
 
+/* A single request header field, name and value share one allocation */
+struct http_header_field
+{
+    char *name;
+    size_t name_len;
+    char *value;
+    size_t value_len;
+};
+
+/* Growable list of request header fields owned by the session */
+struct http_header_list
+{
+    struct http_header_field *fields;
+    size_t count;
+    size_t cap;
+};
+
+/* Request body, binary safe and always NUL terminated, or a file sent as is */
+struct http_body
+{
+    char *data;
+    size_t len;
+    size_t cap;
+    char *file;          // streamed from disk at send time when set
+    long long file_size; // -1 if the file isn't a regular file
+    int borrowed;        // data belongs to the caller, see http_options_set_body_ref()
+};
+
+/* One part of a multipart/form-data body */
+struct http_mime_part
+{
+    char *head;      // delimiter, part headers and, for fields, the value
+    size_t head_len;
+    char *path;      // file opened at send time
+    int fd;          // caller's descriptor, -1 if unused
+    http_read_callback read_cb;
+    void *read_data;
+    long long size;  // bytes sent after head, -1 if unknown
+};
+
+struct http_mime_struct
+{
+    struct http_mime_part *parts;
+    size_t count;
+    size_t cap;
+    char boundary[40];
+    char content_type[72];
+};
+
 /* structure containing the connection information  */
 struct http_conn_info
 {
@@ -57,13 +164,29 @@ struct http_conn_info
     char *query;
     char *user_agent;
     char *connection;
-    char *include_headers;
     char *content_type;
-    char req_headers[MAXREQUEST];
-    char post_body[MAXREQUEST];
-    char put_body[MAXREQUEST];
-    char patch_body[MAXREQUEST];
+    struct http_header_list fields;
+    struct http_body post_body;
+    struct http_body put_body;
+    struct http_body patch_body;
     char cookies[MAXBUFFER];
+    http_read_callback read_cb; // streams the request body when set
+    void *read_data;
+    http_write_callback write_cb; // receives the response body instead of the session
+    void *write_data;
+    http_header_callback header_cb; // sees the final response headers before the body
+    void *header_data;
+    long long drain_limit; // body bytes read to keep the connection after an abort, 0 closes
+    long long body_size;
+    int body_size_known;
+    enum http_body_file_mode file_mode;
+    int read_ahead; // buffers a reader thread fills ahead of the sender, 0 to read inline
+    http_mime mime; // multipart body, owned by the caller
+    enum http_body_encoding encoding;
+    int encoding_level; // 0 for the compressor's default
+    long long expect_continue; // body size from which Expect: 100-continue is sent, 0 never
+    long long max_response;    // largest response body accepted, 0 for no limit
+    int continue_timeout;      // milliseconds, 0 for HTTP_CONTINUE_TIMEOUT
     int res_timeout;
     int http2InUse;
     int max_redirect;
@@ -72,13 +195,58 @@ struct http_conn_info
     enum http_requests method;
     enum http_redirects redirects;
     struct http_proxy proxy;
+    long refs; // sessions sharing these options, see __conn_mut()
+};
+
+/* A piece of the response body, the pieces are chained in arrival order */
+struct http_body_chunk
+{
+    struct http_body_chunk *next;
+    size_t len;
+    size_t cap;
+    char data[]; // cap bytes and a terminating NUL
+};
+
+/* A response header field, offsets into the value copy of the header block */
+struct http_field
+{
+    unsigned name_off;
+    unsigned name_len;
+    unsigned value_off;
+    unsigned value_len;
+    unsigned hash;
+    unsigned folded; // continuation lines are part of the value
+    int next; // next field with the same name, -1 for the last one
+};
+
+/* The response header fields, hashed by name on the first lookup */
+struct http_header_index
+{
+    char *values; // copy of the header block with every value NUL terminated
+    size_t values_cap;
+    size_t len;   // length of the indexed header block, 0 until it belongs to the session
+    int built;
+    struct http_field *fields;
+    size_t count;
+    size_t cap;
+    int *slots; // first field of each name, -1 for free slots
+    size_t nslots;
 };
 
 struct http_response
 {
     char *headers;
-    char body[MAXRESPONSE];
-    char *status_code;
+    struct http_header_index index;
+    struct http_body_chunk *body; // grows one chunk at a time, never moved while receiving
+    struct http_body_chunk *tail;
+    struct http_body_chunk *spare; // emptied chunks kept for the next responses
+    size_t spare_size;
+    size_t body_len;
+    long long content_length; // -1 when the response has none
+    int status;                // status code of the final response, 0 before any
+    enum http_version version; // protocol version of its status line
+    size_t reason_off;         // reason phrase, in headers
+    size_t reason_len;
     enum response_state state;
 };
 
@@ -88,6 +256,7 @@ struct openssl_
     SSL *proxy_ssl;
     int alpn_h2_negotiated;
     enum http_tls_version version;
+    enum http_ktls ktls;
     char *cert_subject;
     char *cert_issuer;
     int is_printed;
@@ -96,12 +265,25 @@ struct openssl_
 /* The structure representing the HTTP session*/
 struct http_session_struct
 {
-    struct http_conn_info connection;
+    struct http_conn_info *connection; // shared copy-on-write between clones
     struct http_response response;
+    char *req_headers; // serialized request, owned per session
+    size_t req_len;
+    size_t req_cap;
     struct openssl_ ssl;
     enum connection_protocol flag;
     enum connection_protocol proxy_flag;
     enum http_verbosity verbose;
+    enum http_zerocopy zerocopy;
+    long long body_raw;  // body bytes of the last request before Content-Encoding
+    long long body_wire; // and as sent, without chunk framing
+    char *preread;       // response bytes read while waiting for 100 Continue
+    size_t preread_len;
+    int body_skipped;    // a final status came before the body, the connection can't be reused
+    struct http_parser *paused; // response the write callback paused, see http_resume()
+    struct timespec req_start;  // when the last request started going out
+    double ttfb;                // seconds until the first response byte, -1 before it
+    int paused_flag;            // read from the proxy connection
     const char *error_msg;
     int error_code;
     int connected;
@@ -112,6 +294,19 @@ struct http_session_struct
     FILE *lfp;
 };
 
+// Internal helpers used before their definition
+void __body_free(struct http_body *b);
+int __body_copy(struct http_body *dest, struct http_body *src);
+int __header_list_copy(struct http_header_list *dest, struct http_header_list *src);
+void __header_list_free(struct http_header_list *l);
+void __response_body_reset(http_session http);
+void __body_chunks_recycle(http_session http, struct http_body_chunk *c);
+void __body_chunks_free(struct http_body_chunk *c);
+void __paused_free(http_session http);
+void __header_index_free(struct http_header_index *x);
+int __header_find(http_session http, const char *name);
+const char *__get_error_msg();
+
 // Set error msg
 void __set_error_msg(http_session http, const char *str_err, ...)
 {
@@ -141,7 +336,13 @@ http_session http_new()
     n = (http_session)calloc(1, sizeof(struct http_session_struct));
     if (!n)
         return NULL;
-    memset(n, 0, sizeof(struct http_session_struct));
+    n->connection = (struct http_conn_info *)calloc(1, sizeof(struct http_conn_info));
+    if (!n->connection)
+    {
+        free(n);
+        return NULL;
+    }
+    n->connection->refs = 1;
     n->error_code = HTTP_SUCCESS;
     __set_error_msg(n, "Success");
     return n;
@@ -169,20 +370,171 @@ const char *libhttp_get_version(void)
 
     return strdup(v);
 }
+// Drop a reference to shared options, freeing them with the last session
+void __conn_release(struct http_conn_info *c)
+{
+    if (__refs_dec(&c->refs) == 0)
+    {
+        __header_list_free(&c->fields);
+        __body_free(&c->post_body);
+        __body_free(&c->put_body);
+        __body_free(&c->patch_body);
+        free(c);
+    }
+}
+
+// Give a copy of the options its own header fields and bodies
+int __conn_copy_owned(struct http_conn_info *n, struct http_conn_info *c)
+{
+    memset(&n->fields, 0, sizeof(n->fields));
+    memset(&n->post_body, 0, sizeof(n->post_body));
+    memset(&n->put_body, 0, sizeof(n->put_body));
+    memset(&n->patch_body, 0, sizeof(n->patch_body));
+
+    if (__header_list_copy(&n->fields, &c->fields) == HTTP_OK &&
+        __body_copy(&n->post_body, &c->post_body) == HTTP_OK &&
+        __body_copy(&n->put_body, &c->put_body) == HTTP_OK &&
+        __body_copy(&n->patch_body, &c->patch_body) == HTTP_OK)
+        return HTTP_OK;
+
+    __header_list_free(&n->fields);
+    __body_free(&n->post_body);
+    __body_free(&n->put_body);
+    __body_free(&n->patch_body);
+    return HTTP_ERROR;
+}
+
+/**
+ * Options are shared between clones until one of them modifies them.
+ * Must be called before writing to http->connection, gives the session
+ * its own copy if the options are shared.
+ */
+int __conn_mut(http_session http)
+{
+    struct http_conn_info *c = http->connection;
+    if (__refs_get(&c->refs) == 1)
+        return HTTP_OK;
+
+    struct http_conn_info *n = (struct http_conn_info *)malloc(sizeof(*n));
+    if (n)
+        memcpy(n, c, sizeof(*n));
+    if (!n || __conn_copy_owned(n, c) != HTTP_OK)
+    {
+        free(n);
+        __set_error_msg(http, "%s", __get_error_msg());
+        http->error_code = errno;
+        return HTTP_ERROR;
+    }
+    n->refs = 1;
+    http->connection = n;
+    __conn_release(c);
+    return HTTP_OK;
+}
+
+/**
+ * Clone a session for fan-out.
+ * The clone shares the options of src by reference count and copies them
+ * only when either session modifies them. The clone is not connected and
+ * has no response.
+ * @returns a new session, free it with http_free()
+ */
+http_session http_clone(http_session src)
+{
+    http_session n = (http_session)calloc(1, sizeof(struct http_session_struct));
+    if (!n)
+        return NULL;
+
+    n->connection = src->connection;
+    __refs_inc(&n->connection->refs);
+    n->ssl.version = src->ssl.version;
+    n->ssl.ktls = src->ssl.ktls;
+    n->flag = src->flag;
+    n->proxy_flag = src->proxy_flag;
+    n->verbose = src->verbose;
+    n->zerocopy = src->zerocopy;
+    n->lfp = src->lfp;
+    n->error_code = HTTP_SUCCESS;
+    __set_error_msg(n, "Success");
+    return n;
+}
+
 /* Copy http_session from src to dest*/
 void http_options_copy(http_session dest, http_session src)
 {
+    if (dest == src)
+        return;
 
+    // The options are shared, the request buffer and response stay with dest
+    struct http_conn_info *c = dest->connection;
+    char *req_headers = dest->req_headers;
+    size_t req_cap = dest->req_cap;
+    char *preread = dest->preread;
+
+    free(dest->response.headers);
+    __header_index_free(&dest->response.index);
+    __response_body_reset(dest);
+    __paused_free(dest);
+    struct http_body_chunk *spare = dest->response.spare;
+    size_t spare_size = dest->response.spare_size;
     memcpy(dest, src, sizeof(struct http_session_struct));
     memset(&dest->response, 0, sizeof dest->response);
+    __refs_inc(&dest->connection->refs);
+    __conn_release(c);
+
+    dest->req_headers = req_headers;
+    dest->req_len = 0;
+    dest->req_cap = req_cap;
+    dest->response.spare = spare;
+    dest->response.spare_size = spare_size;
+    dest->preread = preread;
+    dest->preread_len = 0;
+    dest->paused = NULL;
 }
 
 void http_options_clear(http_session http)
 {
+    if (__conn_mut(http) != HTTP_OK)
+        return;
+
+    struct http_conn_info *c = http->connection;
+    char *req_headers = http->req_headers;
+    size_t req_cap = http->req_cap;
+    char *preread = http->preread;
+
+    free(http->response.headers);
+    __header_index_free(&http->response.index);
+    __response_body_reset(http);
+    __paused_free(http);
+    struct http_body_chunk *spare = http->response.spare;
+    size_t spare_size = http->response.spare_size;
+    __header_list_free(&c->fields);
+    __body_free(&c->post_body);
+    __body_free(&c->put_body);
+    __body_free(&c->patch_body);
+    memset(c, 0, sizeof(*c));
+    c->refs = 1;
     memset(http, 0, sizeof(struct http_session_struct));
+
+    http->connection = c;
+    http->req_headers = req_headers;
+    http->req_cap = req_cap;
+    http->response.spare = spare;
+    http->response.spare_size = spare_size;
+    http->preread = preread;
 }
 // free alocated resource
-void http_free(http_session http) { free(http); }
+void http_free(http_session http)
+{
+    __conn_release(http->connection);
+    free(http->req_headers);
+    free(http->response.headers);
+    __header_index_free(&http->response.index);
+    __body_chunks_free(http->response.body);
+    __body_chunks_free(http->response.spare);
+    __paused_free(http);
+    free(http->preread);
+    free(http);
+}
 
 // Shutdown connection
 void http_disconnect(http_session http)
@@ -203,8 +555,8 @@ void http_proxy_disconnect(http_session http)
 {
     if (http->proxy_flag == HTTPS)
     {
-        SSL_shutdown(http->ssl.ssl);
-        SSL_free(http->ssl.ssl);
+        SSL_shutdown(http->ssl.proxy_ssl);
+        SSL_free(http->ssl.proxy_ssl);
     }
 #ifdef _WIN32
     WSACleanup();
@@ -219,16 +571,16 @@ void __parse_url(http_session http, char **hostname, char **port, char **path, c
     int flag = 0;
     char *p;
     *path = "";
-    if (strstr(http->connection.url, "https://"))
+    if (strstr(http->connection->url, "https://"))
     {
         flag = 1;
         http->flag = HTTPS;
-        p = strdup(strstr(http->connection.url, "https://"));
+        p = strdup(strstr(http->connection->url, "https://"));
         p += 8;
     }
-    else if (strstr(http->connection.url, "http://"))
+    else if (strstr(http->connection->url, "http://"))
     {
-        p = strdup(strstr(http->connection.url, "http://"));
+        p = strdup(strstr(http->connection->url, "http://"));
         p += 7;
         http->flag = HTTP;
     }
@@ -269,9 +621,9 @@ void __parse_url(http_session http, char **hostname, char **port, char **path, c
     }
 
     char *k;
-    if (strstr(http->connection.url, "?"))
+    if (strstr(http->connection->url, "?"))
     {
-        k = strdup(strstr(http->connection.url, "?"));
+        k = strdup(strstr(http->connection->url, "?"));
         k += 1;
         *query = k;
 
@@ -288,16 +640,16 @@ void __parse_proxy_url(http_session http, char **hostname, char **port)
 
     int flag = 0;
     char *p;
-    if (strstr(http->connection.proxy.url, "https://"))
+    if (strstr(http->connection->proxy.url, "https://"))
     {
         flag = 1;
         http->proxy_flag = HTTPS;
-        p = strdup(strstr(http->connection.proxy.url, "https://"));
+        p = strdup(strstr(http->connection->proxy.url, "https://"));
         p += 8;
     }
-    else if (strstr(http->connection.proxy.url, "http://"))
+    else if (strstr(http->connection->proxy.url, "http://"))
     {
-        p = strdup(strstr(http->connection.proxy.url, "http://"));
+        p = strdup(strstr(http->connection->proxy.url, "http://"));
         p += 7;
         http->proxy_flag = HTTP;
     }
@@ -511,258 +863,905 @@ const char *__get_error_msg()
 #endif
 }
 
-// setting session options
-int http_options_set(http_session http,
-                     enum http_options option, const void *value)
+// Case insensitive comparison of two strings of length n
+int __strncaseeq(const char *a, const char *b, size_t n)
 {
+    for (size_t i = 0; i < n; i++)
+    {
+        unsigned char x = (unsigned char)a[i], y = (unsigned char)b[i];
+        if (x >= 'A' && x <= 'Z')
+            x += 'a' - 'A';
+        if (y >= 'A' && y <= 'Z')
+            y += 'a' - 'A';
+        if (x != y)
+            return 0;
+    }
+    return 1;
+}
 
-    char *tmp;
-    const int *val;
-    if (option != HTTP_OPTIONS_LOGGING_FP)
+// Find a field by name (case insensitive) starting at index from, -1 if not found
+long __header_list_find(struct http_header_list *l, const char *name, size_t name_len, size_t from)
+{
+    for (size_t i = from; i < l->count; i++)
     {
-        tmp = (char *)value;
-        val = *((int const **)value);
+        if (l->fields[i].name_len == name_len &&
+            __strncaseeq(l->fields[i].name, name, name_len))
+            return (long)i;
     }
+    return -1;
+}
 
-    if (option == HTTP_OPTIONS_POST_BODY_FILE || option == HTTP_OPTIONS_PUT_BODY_FILE ||
-        option == HTTP_OPTIONS_PATCH_BODY_FILE || option == HTTP_OPTIONS_LOAD_COOKIES_FILE)
+// Fill a field with a copy of name and value
+int __header_field_init(struct http_header_field *f, const char *name, size_t name_len,
+                        const char *value, size_t value_len)
+{
+    char *mem = (char *)malloc(name_len + value_len + 2);
+    if (!mem)
+        return HTTP_ERROR;
+
+    memcpy(mem, name, name_len);
+    mem[name_len] = 0;
+    memcpy(mem + name_len + 1, value, value_len);
+    mem[name_len + 1 + value_len] = 0;
+
+    f->name = mem;
+    f->name_len = name_len;
+    f->value = mem + name_len + 1;
+    f->value_len = value_len;
+    return HTTP_OK;
+}
+
+int __header_list_add(struct http_header_list *l, const char *name, size_t name_len,
+                      const char *value, size_t value_len)
+{
+    if (l->count == l->cap)
     {
-        FILE *fp;
-        fp = fopen(tmp, "r");
-        if (fp == NULL)
-        {
-            __set_error_msg(http, "%s", __get_error_msg());
-            http->error_code = errno;
+        size_t cap = l->cap ? l->cap * 2 : 8;
+        struct http_header_field *fields = (struct http_header_field *)realloc(
+            l->fields, cap * sizeof(*fields));
+        if (!fields)
             return HTTP_ERROR;
-        }
-        char buf[2048];
-        int r = fread(buf, 1, 2048, fp);
+        l->fields = fields;
+        l->cap = cap;
+    }
+    if (__header_field_init(&l->fields[l->count], name, name_len, value, value_len) != HTTP_OK)
+        return HTTP_ERROR;
+    l->count++;
+    return HTTP_OK;
+}
 
-        while (r)
-        {
+void __header_list_remove_at(struct http_header_list *l, size_t i)
+{
+    free(l->fields[i].name);
+    memmove(&l->fields[i], &l->fields[i + 1], (l->count - i - 1) * sizeof(*l->fields));
+    l->count--;
+}
 
-            if (option == HTTP_OPTIONS_POST_BODY_FILE)
-            {
-                sprintf(http->connection.post_body +
-                            strlen(http->connection.post_body),
-                        "%s", buf);
-            }
-            else if (option == HTTP_OPTIONS_PATCH_BODY_FILE)
-            {
-                sprintf(http->connection.patch_body +
-                            strlen(http->connection.patch_body),
-                        "%s", buf);
-            }
-            else if (option == HTTP_OPTIONS_LOAD_COOKIES_FILE)
-            {
+void __header_list_free(struct http_header_list *l)
+{
+    for (size_t i = 0; i < l->count; i++)
+        free(l->fields[i].name);
+    free(l->fields);
+    memset(l, 0, sizeof(*l));
+}
 
-                // replace all newline characters with a backfeed
-                char *ptr = buf;
-                while (1)
-                {
-                    while (*ptr && *ptr != '\n')
-                        *ptr++;
-                    if (*ptr == '\n')
-                    {
-                        *ptr = '\b';
-                    }
-                    else
-                    {
-                        break;
-                    }
-                }
-                sprintf(http->connection.cookies +
-                            strlen(http->connection.cookies),
-                        "%s", buf);
-            }
-            else
-            {
-                sprintf(http->connection.put_body +
-                            strlen(http->connection.put_body),
-                        "%s", buf);
-            }
-            r = fread(buf, 1, 2048, fp);
-        }
-        fflush(fp);
-        fclose(fp);
-        return HTTP_OK;
-    }
-    switch (option)
+// Deep copy src into dest, dest must be empty
+int __header_list_copy(struct http_header_list *dest, struct http_header_list *src)
+{
+    memset(dest, 0, sizeof(*dest));
+    for (size_t i = 0; i < src->count; i++)
     {
-    case HTTP_OPTIONS_URL:
-        http->connection.url = tmp;
-        __parse_url(http, &http->connection.hostname,
-                    &http->connection.port, &http->connection.path, &http->connection.query);
-        if (!http->connection.hostname || !http->connection.port)
-        {
-            __set_error_msg(http, "Invalid URL");
-            http->error_code = HTTP_INVALID_URL;
-            return HTTP_ERROR;
-        }
-        break;
-    case HTTP_OPTIONS_HOSTNAME:
-        http->connection.hostname = strdup(tmp);
-        break;
-    case HTTP_OPTIONS_PORT:
-        http->connection.port = strdup(tmp);
-        break;
-    case HTTP_OPTIONS_PATH:
-        http->connection.path = strdup(tmp);
-        break;
-    case HTTP_OPTIONS_QUERY:
-        http->connection.query = strdup(tmp);
-        break;
-    case HTTP_OPTIONS_REQUEST_METHOD:
-        http->connection.method = (enum http_requests)val;
-        break;
-    case HTTP_OPTIONS_HEADERS:
-        http->connection.headers = strdup(tmp);
-        break;
-    case HTTP_OPTIONS_CONTENT_TYPE_HEADER:
-        http->connection.content_type = strdup(tmp);
-        break;
-    case HTTP_OPTIONS_HTTP_VERSION:
-        http->connection.version = (enum http_version)val;
-        break;
-    case HTTP_OPTIONS_TLS_VERSION:
-        http->ssl.version = (enum http_tls_version)val;
-        break;
-    case HTTP_OPTIONS_REDIRECTS:
-        http->connection.redirects = (enum http_redirects)val;
-        break;
-    case HTTP_OPTIONS_MAX_REDIRECT:
-        http->connection.max_redirect = *val;
-        break;
-    case HTTP_OPTIONS_RESPONSE_TIMEOUT:
-        http->connection.res_timeout = *val;
-        // Handle
-        break;
-    case HTTP_OPTIONS_POST_BODY:
-        sprintf(http->connection.post_body, "%s", tmp);
-        break;
-    case HTTP_OPTIONS_PATCH_BODY:
-        sprintf(http->connection.patch_body, "%s", tmp);
-        break;
-    case HTTP_OPTIONS_LOAD_COOKIES:
-        sprintf(http->connection.cookies, "%s", tmp);
-        break;
-    case HTTP_OPTIONS_PUT_BODY:
-        sprintf(http->connection.put_body, "%s", tmp);
-        break;
-    case HTTP_OPTIONS_VERBOSITY:
-        http->verbose = (enum http_verbosity)val;
-        break;
-    case HTTP_OPTIONS_LOGGING_FP:
-        http->lfp = (FILE *)value;
-        break;
-    case HTTP_OPTIONS_PROXY_URL:
-        http->connection.proxy.url = strdup(tmp);
-        __parse_proxy_url(http, &http->connection.proxy.hostname,
-                          &http->connection.proxy.port);
-        if (!http->connection.proxy.hostname || !http->connection.proxy.port)
+        struct http_header_field *f = &src->fields[i];
+        if (__header_list_add(dest, f->name, f->name_len, f->value, f->value_len) != HTTP_OK)
         {
-            __set_error_msg(http, "Invalid URL");
-            http->error_code = HTTP_INVALID_URL;
+            __header_list_free(dest);
             return HTTP_ERROR;
         }
-        break;
-    case HTTP_OPTIONS_PROXY_HOSTNAME:
-        http->connection.proxy.hostname = strdup(tmp);
-        break;
-    case HTTP_OPTIONS_PROXY_PORT:
-        http->connection.proxy.port = strdup(tmp);
-        break;
-    case HTTP_OPTIONS_HEADERS_INCLUDE:
-        http->connection.include_headers = strdup(tmp);
-        break;
-    case HTTP_OPTIONS_USER_AGENT:
-        http->connection.user_agent = strdup(tmp);
-        break;
-    case HTTP_OPTIONS_CONNECTION_HEADER:
-        http->connection.connection = strdup(tmp);
-        break;
-    default:
-        return HTTP_ERROR;
     }
-
     return HTTP_OK;
 }
 
-// Get an HTTP option and write it to value
-int http_options_get(http_session http, enum http_options option, char **value)
+// Header names are tokens and values can't break out of their line
+int __header_is_valid(const char *name, size_t name_len, const char *value)
 {
-
-    switch (option)
+    if (name_len == 0)
+        return 0;
+    for (size_t i = 0; i < name_len; i++)
     {
-    case HTTP_OPTIONS_URL:
-        *value = http->connection.url;
-        break;
-    case HTTP_OPTIONS_HOSTNAME:
-        *value = http->connection.hostname;
-        break;
-    case HTTP_OPTIONS_PORT:
-        *value = http->connection.port;
-        break;
-    case HTTP_OPTIONS_PATH:
-        *value = http->connection.path;
-        break;
-    case HTTP_OPTIONS_QUERY:
-        *value = http->connection.query;
-        break;
-    case HTTP_OPTIONS_HEADERS:
-        *value = http->connection.headers;
-        break;
-    case HTTP_OPTIONS_POST_BODY:
-        *value = http->connection.post_body;
-        break;
-    case HTTP_OPTIONS_PATCH_BODY:
-        *value = http->connection.patch_body;
-        break;
-    case HTTP_OPTIONS_CONTENT_TYPE_HEADER:
-        *value = http->connection.content_type;
-        break;
-    case HTTP_OPTIONS_LOAD_COOKIES:
-        *value = http->connection.cookies;
-        break;
-    case HTTP_OPTIONS_PUT_BODY:
-        *value = http->connection.put_body;
-        break;
-    case HTTP_OPTIONS_PROXY_URL:
-        *value = http->connection.proxy.url;
-        break;
-    case HTTP_OPTIONS_PROXY_HOSTNAME:
-        *value = http->connection.proxy.hostname;
-        break;
-    case HTTP_OPTIONS_PROXY_PORT:
-        *value = http->connection.proxy.port;
-        break;
-    default:
-        return HTTP_ERROR;
+        if (name[i] <= ' ' || name[i] == ':' || name[i] == 127)
+            return 0;
     }
+    return strpbrk(value, "\r\n") == NULL;
+}
 
-    return HTTP_OK;
+int __header_invalid(http_session http, const char *name)
+{
+    __set_error_msg(http, "Invalid header field '%.100s'", name ? name : "(null)");
+    http->error_code = HTTP_INVALID_HEADER;
+    return HTTP_ERROR;
 }
 
-// Get request method
-int http_options_get_request_method(http_session http)
+int __header_no_memory(http_session http)
 {
-    if (http->connection.method < 1)
-        return HTTP_GET;
-    else
-        return http->connection.method;
+    __set_error_msg(http, "%s", __get_error_msg());
+    http->error_code = errno;
+    return HTTP_ERROR;
 }
 
-// Get http version
-int http_options_get_http_version(http_session http)
+/**
+ * Add a request header field, keeping fields with the same name
+ * @returns HTTP_OK or HTTP_ERROR
+ */
+int http_header_add(http_session http, const char *name, const char *value)
 {
-    if (http->connection.version < 1)
-        return HTTP_1_1;
-    else
-        return http->connection.version;
+    if (!name || !value || !__header_is_valid(name, strlen(name), value))
+        return __header_invalid(http, name);
+    if (__conn_mut(http) != HTTP_OK)
+        return HTTP_ERROR;
+
+    if (__header_list_add(&http->connection->fields, name, strlen(name),
+                          value, strlen(value)) != HTTP_OK)
+        return __header_no_memory(http);
+    return HTTP_OK;
 }
-int http_get_error_code(http_session http)
+
+/**
+ * Set a request header field, replacing every field with the same name
+ * (case insensitive). The field keeps the position of the first match.
+ * @returns HTTP_OK or HTTP_ERROR
+ */
+int http_header_set(http_session http, const char *name, const char *value)
 {
-    return http->error_code;
+    if (!name || !value || !__header_is_valid(name, strlen(name), value))
+        return __header_invalid(http, name);
+    if (__conn_mut(http) != HTTP_OK)
+        return HTTP_ERROR;
+
+    struct http_header_list *l = &http->connection->fields;
+    size_t name_len = strlen(name);
+    long i = __header_list_find(l, name, name_len, 0);
+    if (i < 0)
+        return http_header_add(http, name, value);
+
+    struct http_header_field f;
+    if (__header_field_init(&f, name, name_len, value, strlen(value)) != HTTP_OK)
+        return __header_no_memory(http);
+    free(l->fields[i].name);
+    l->fields[i] = f;
+
+    long j;
+    while ((j = __header_list_find(l, name, name_len, i + 1)) >= 0)
+        __header_list_remove_at(l, j);
+    return HTTP_OK;
+}
+
+/**
+ * Remove every request header field with this name (case insensitive)
+ * @returns HTTP_OK, or HTTP_ERROR if no field matched
+ */
+int http_header_remove(http_session http, const char *name)
+{
+    if (!name)
+        return __header_invalid(http, name);
+    if (__conn_mut(http) != HTTP_OK)
+        return HTTP_ERROR;
+
+    struct http_header_list *l = &http->connection->fields;
+    size_t name_len = strlen(name);
+    long i, removed = 0;
+    while ((i = __header_list_find(l, name, name_len, 0)) >= 0)
+    {
+        __header_list_remove_at(l, i);
+        removed++;
+    }
+    return removed ? HTTP_OK : HTTP_ERROR;
+}
+
+/**
+ * Split a block of "Name: value" lines (HTTP_OPTIONS_HEADERS_INCLUDE)
+ * into the header list once, lines without a colon are ignored
+ */
+int __header_list_parse(http_session http, const char *str)
+{
+    const char *line = str;
+    while (*line)
+    {
+        const char *eol = strchr(line, '\n');
+        const char *next = eol ? eol + 1 : line + strlen(line);
+        if (!eol)
+            eol = next;
+        if (eol > line && eol[-1] == '\r')
+            eol--;
+
+        const char *colon = memchr(line, ':', eol - line);
+        if (colon)
+        {
+            const char *name_end = colon, *value = colon + 1;
+            while (name_end > line && (name_end[-1] == ' ' || name_end[-1] == '\t'))
+                name_end--;
+            while (value < eol && (*value == ' ' || *value == '\t'))
+                value++;
+
+            if (name_end == line)
+                return __header_invalid(http, line);
+            if (__header_list_add(&http->connection->fields, line, name_end - line,
+                                  value, eol - value) != HTTP_OK)
+                return __header_no_memory(http);
+        }
+        line = next;
+    }
+    return HTTP_OK;
+}
+
+void __body_free(struct http_body *b)
+{
+    if (!b->borrowed)
+        free(b->data);
+    free(b->file);
+    memset(b, 0, sizeof(*b));
+}
+
+int __body_copy(struct http_body *dest, struct http_body *src)
+{
+    memset(dest, 0, sizeof(*dest));
+    if (src->borrowed)
+    {
+        *dest = *src;
+        return HTTP_OK;
+    }
+    if (src->file)
+    {
+        dest->file = strdup(src->file);
+        dest->file_size = src->file_size;
+        return dest->file ? HTTP_OK : HTTP_ERROR;
+    }
+    if (!src->data)
+        return HTTP_OK;
+    dest->data = (char *)malloc(src->len + 1);
+    if (!dest->data)
+        return HTTP_ERROR;
+    memcpy(dest->data, src->data, src->len + 1);
+    dest->len = src->len;
+    dest->cap = src->len + 1;
+    return HTTP_OK;
+}
+
+// Append len bytes to the body, growing it geometrically
+int __body_append(http_session http, struct http_body *b, const void *data, size_t len)
+{
+    if (b->len + len + 1 > b->cap)
+    {
+        size_t cap = b->cap ? b->cap : 256;
+        while (cap < b->len + len + 1)
+            cap *= 2;
+        char *n = (char *)realloc(b->data, cap);
+        if (!n)
+        {
+            __set_error_msg(http, "%s", __get_error_msg());
+            http->error_code = errno;
+            return HTTP_ERROR;
+        }
+        b->data = n;
+        b->cap = cap;
+    }
+    memcpy(b->data + b->len, data, len);
+    b->len += len;
+    b->data[b->len] = 0;
+    return HTTP_OK;
+}
+
+// The body set by a POST, PUT or PATCH body option, NULL for other options
+struct http_body *__body_of(struct http_conn_info *c, enum http_options option)
+{
+    switch (option)
+    {
+    case HTTP_OPTIONS_POST_BODY:
+    case HTTP_OPTIONS_POST_BODY_FILE:
+        return &c->post_body;
+    case HTTP_OPTIONS_PUT_BODY:
+    case HTTP_OPTIONS_PUT_BODY_FILE:
+        return &c->put_body;
+    case HTTP_OPTIONS_PATCH_BODY:
+    case HTTP_OPTIONS_PATCH_BODY_FILE:
+        return &c->patch_body;
+    default:
+        return NULL;
+    }
+}
+
+/**
+ * Use a file as the body. Only the path and size are recorded,
+ * the file is streamed when the request is sent.
+ */
+int __body_set_file(http_session http, struct http_body *b, const char *path)
+{
+    struct stat st;
+    char *file;
+    if (stat(path, &st) != 0 || !(file = strdup(path)))
+    {
+        __set_error_msg(http, "%s", __get_error_msg());
+        http->error_code = errno;
+        return HTTP_ERROR;
+    }
+    __body_free(b);
+    b->file = file;
+    b->file_size = S_ISREG(st.st_mode) ? (long long)st.st_size : -1;
+    return HTTP_OK;
+}
+
+// The empty, writable body for a POST, PUT or PATCH body option
+struct http_body *__body_option(http_session http, enum http_options option)
+{
+    struct http_body *b = __body_of(http->connection, option);
+    if (!b || option == HTTP_OPTIONS_POST_BODY_FILE || option == HTTP_OPTIONS_PUT_BODY_FILE ||
+        option == HTTP_OPTIONS_PATCH_BODY_FILE)
+    {
+        __set_error_msg(http, "Not a request body option");
+        http->error_code = HTTP_INVALID_OPTION;
+        return NULL;
+    }
+    if (__conn_mut(http) != HTTP_OK)
+        return NULL;
+
+    b = __body_of(http->connection, option);
+    if (b->borrowed || b->file)
+        __body_free(b);
+    b->len = 0;
+    return b;
+}
+
+/**
+ * Set the POST, PUT or PATCH body to len bytes of data, which may contain
+ * NUL bytes. The data is copied.
+ */
+int http_options_set_body(http_session http, enum http_options option,
+                          const void *data, size_t len)
+{
+    struct http_body *b = __body_option(http, option);
+    if (!b)
+        return HTTP_ERROR;
+    return __body_append(http, b, data, len);
+}
+
+/**
+ * Like http_options_set_body() but the data isn't copied, it must stay
+ * valid and unchanged until the requests using it have been sent.
+ * With HTTP_OPTIONS_ZEROCOPY the kernel is done with it once
+ * http_session_start() returns.
+ */
+int http_options_set_body_ref(http_session http, enum http_options option,
+                              const void *data, size_t len)
+{
+    struct http_body *b = __body_option(http, option);
+    if (!b)
+        return HTTP_ERROR;
+    __body_free(b);
+    b->data = (char *)data;
+    b->len = len;
+    b->borrowed = 1;
+    return HTTP_OK;
+}
+
+/**
+ * Create an empty multipart/form-data body. Attach it to a session with
+ * HTTP_OPTIONS_MIME, it is streamed as the POST, PUT or PATCH body
+ */
+http_mime http_mime_new(void)
+{
+    unsigned char rnd[12];
+    http_mime mime = (http_mime)calloc(1, sizeof(*mime));
+    if (!mime)
+        return NULL;
+
+    if (RAND_bytes(rnd, sizeof(rnd)) != 1)
+    {
+        for (size_t i = 0; i < sizeof(rnd); i++)
+            rnd[i] = (unsigned char)(rand() ^ (time(NULL) >> (i % 4 * 8)));
+    }
+    int n = sprintf(mime->boundary, "----libhttp");
+    for (size_t i = 0; i < sizeof(rnd); i++)
+        n += sprintf(mime->boundary + n, "%02x", rnd[i]);
+    sprintf(mime->content_type, "multipart/form-data; boundary=%s", mime->boundary);
+    return mime;
+}
+
+void http_mime_free(http_mime mime)
+{
+    if (!mime)
+        return;
+    for (size_t i = 0; i < mime->count; i++)
+    {
+        free(mime->parts[i].head);
+        free(mime->parts[i].path);
+    }
+    free(mime->parts);
+    free(mime);
+}
+
+// Quote a form-data parameter the way browsers do, out needs 3 bytes per character
+size_t __mime_quote(char *out, const char *str)
+{
+    size_t n = 0;
+    out[n++] = '"';
+    for (; *str; str++)
+    {
+        if (*str == '"')
+            memcpy(out + n, "%22", 3), n += 3;
+        else if (*str == '\r')
+            memcpy(out + n, "%0D", 3), n += 3;
+        else if (*str == '\n')
+            memcpy(out + n, "%0A", 3), n += 3;
+        else
+            out[n++] = *str;
+    }
+    out[n++] = '"';
+    return n;
+}
+
+/**
+ * Add a part and serialize its delimiter and headers, followed by len bytes
+ * of value for fields. Every part but the first starts with the CRLF ending
+ * the previous one.
+ */
+struct http_mime_part *__mime_part(http_mime mime, const char *name, const char *filename,
+                                   const char *type, const void *value, size_t len)
+{
+    // type goes into the part headers as is, so it can't break out of its line
+    if (!mime || !name || (type && strpbrk(type, "\r\n")))
+    {
+        errno = EINVAL;
+        return NULL;
+    }
+    if (mime->count == mime->cap)
+    {
+        size_t cap = mime->cap ? mime->cap * 2 : 4;
+        struct http_mime_part *parts = (struct http_mime_part *)realloc(
+            mime->parts, cap * sizeof(*parts));
+        if (!parts)
+            return NULL;
+        mime->parts = parts;
+        mime->cap = cap;
+    }
+
+    size_t max = 2 + 2 + strlen(mime->boundary) + 2 + 64 + 3 * strlen(name) + 2 + len;
+    if (filename)
+        max += 16 + 3 * strlen(filename);
+    if (type)
+        max += 16 + strlen(type);
+    char *head = (char *)malloc(max);
+    if (!head)
+        return NULL;
+
+    size_t n = sprintf(head, "%s--%s\r\nContent-Disposition: form-data; name=",
+                       mime->count ? "\r\n" : "", mime->boundary);
+    n += __mime_quote(head + n, name);
+    if (filename)
+    {
+        n += sprintf(head + n, "; filename=");
+        n += __mime_quote(head + n, filename);
+    }
+    n += sprintf(head + n, "\r\n");
+    if (type)
+        n += sprintf(head + n, "Content-Type: %s\r\n", type);
+    n += sprintf(head + n, "\r\n");
+    if (len)
+        memcpy(head + n, value, len);
+
+    struct http_mime_part *p = &mime->parts[mime->count++];
+    memset(p, 0, sizeof(*p));
+    p->head = head;
+    p->head_len = n + len;
+    p->fd = -1;
+    return p;
+}
+
+// Add a field of len bytes, the value is copied
+int http_mime_add_field(http_mime mime, const char *name, const void *value, size_t len)
+{
+    return __mime_part(mime, name, NULL, NULL, value, len) ? HTTP_OK : HTTP_ERROR;
+}
+
+/**
+ * Add a file part, streamed from path when the request is sent. filename
+ * defaults to the last component of path
+ */
+int http_mime_add_file(http_mime mime, const char *name, const char *path,
+                       const char *filename, const char *type)
+{
+    struct stat st;
+    char *file;
+    if (!path || stat(path, &st) != 0 || !(file = strdup(path)))
+        return HTTP_ERROR;
+    if (!filename)
+        filename = strrchr(path, '/') ? strrchr(path, '/') + 1 : path;
+
+    struct http_mime_part *p = __mime_part(mime, name, filename,
+                                           type ? type : "application/octet-stream", NULL, 0);
+    if (!p)
+    {
+        free(file);
+        return HTTP_ERROR;
+    }
+    p->path = file;
+    p->size = S_ISREG(st.st_mode) ? (long long)st.st_size : -1;
+    return HTTP_OK;
+}
+
+/**
+ * Add a part read from fd, which stays open and owned by the caller.
+ * Regular files are sent whole from the start, anything else until EOF
+ */
+int http_mime_add_fd(http_mime mime, const char *name, int fd,
+                     const char *filename, const char *type)
+{
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0)
+        return HTTP_ERROR;
+
+    struct http_mime_part *p = __mime_part(mime, name, filename,
+                                           type ? type : "application/octet-stream", NULL, 0);
+    if (!p)
+        return HTTP_ERROR;
+    p->fd = fd;
+    p->size = S_ISREG(st.st_mode) ? (long long)st.st_size : -1;
+    return HTTP_OK;
+}
+
+// Add a part produced by read_cb, size is -1 if unknown
+int http_mime_add_callback(http_mime mime, const char *name, http_read_callback read_cb,
+                           void *userdata, long long size, const char *filename, const char *type)
+{
+    if (!read_cb)
+        return HTTP_ERROR;
+    struct http_mime_part *p = __mime_part(mime, name, filename,
+                                           type ? type : "application/octet-stream", NULL, 0);
+    if (!p)
+        return HTTP_ERROR;
+    p->read_cb = read_cb;
+    p->read_data = userdata;
+    p->size = size < 0 ? -1 : size;
+    return HTTP_OK;
+}
+
+// Encoded size of the body, -1 if a part's size is only known once it is read
+long long http_mime_size(http_mime mime)
+{
+    long long size = (mime->count ? 2 : 0) + 2 + strlen(mime->boundary) + 4;
+    for (size_t i = 0; i < mime->count; i++)
+    {
+        if (mime->parts[i].size < 0)
+            return -1;
+        size += mime->parts[i].head_len + mime->parts[i].size;
+    }
+    return size;
+}
+
+// Content-Type carrying the boundary, sent automatically with HTTP_OPTIONS_MIME
+const char *http_mime_content_type(http_mime mime)
+{
+    return mime->content_type;
+}
+
+// setting session options
+int http_options_set(http_session http,
+                     enum http_options option, const void *value)
+{
+
+    char *tmp = (char *)value;
+    const int *val = NULL;
+    // Only numeric options are read through value, strings may be shorter than a pointer
+    switch (option)
+    {
+    case HTTP_OPTIONS_REQUEST_METHOD:
+    case HTTP_OPTIONS_HTTP_VERSION:
+    case HTTP_OPTIONS_TLS_VERSION:
+    case HTTP_OPTIONS_KTLS:
+    case HTTP_OPTIONS_ZEROCOPY:
+    case HTTP_OPTIONS_BODY_FILE_MODE:
+    case HTTP_OPTIONS_BODY_READ_AHEAD:
+    case HTTP_OPTIONS_BODY_ENCODING:
+    case HTTP_OPTIONS_BODY_ENCODING_LEVEL:
+    case HTTP_OPTIONS_EXPECT_CONTINUE:
+    case HTTP_OPTIONS_EXPECT_CONTINUE_TIMEOUT:
+    case HTTP_OPTIONS_MAX_RESPONSE_SIZE:
+    case HTTP_OPTIONS_ABORT_DRAIN_LIMIT:
+    case HTTP_OPTIONS_REDIRECTS:
+    case HTTP_OPTIONS_MAX_REDIRECT:
+    case HTTP_OPTIONS_RESPONSE_TIMEOUT:
+    case HTTP_OPTIONS_VERBOSITY:
+        val = *((int const **)value);
+        break;
+    default:
+        break;
+    }
+
+    // Everything except the per session settings lives in the shared options
+    if (option != HTTP_OPTIONS_VERBOSITY && option != HTTP_OPTIONS_LOGGING_FP &&
+        option != HTTP_OPTIONS_TLS_VERSION && option != HTTP_OPTIONS_KTLS &&
+        option != HTTP_OPTIONS_ZEROCOPY && __conn_mut(http) != HTTP_OK)
+        return HTTP_ERROR;
+
+    if (option == HTTP_OPTIONS_POST_BODY_FILE || option == HTTP_OPTIONS_PUT_BODY_FILE ||
+        option == HTTP_OPTIONS_PATCH_BODY_FILE)
+        return __body_set_file(http, __body_of(http->connection, option), tmp);
+
+    if (option == HTTP_OPTIONS_LOAD_COOKIES_FILE)
+    {
+        FILE *fp;
+        fp = fopen(tmp, "r");
+        if (fp == NULL)
+        {
+            __set_error_msg(http, "%s", __get_error_msg());
+            http->error_code = errno;
+            return HTTP_ERROR;
+        }
+        char buf[2048];
+        int r = fread(buf, 1, 2047, fp);
+
+        while (r)
+        {
+            buf[r] = 0;
+            // replace all newline characters with a backfeed
+            char *ptr = buf;
+            while (1)
+            {
+                while (*ptr && *ptr != '\n')
+                    *ptr++;
+                if (*ptr == '\n')
+                {
+                    *ptr = '\b';
+                }
+                else
+                {
+                    break;
+                }
+            }
+            sprintf(http->connection->cookies +
+                        strlen(http->connection->cookies),
+                    "%s", buf);
+            r = fread(buf, 1, 2047, fp);
+        }
+        fflush(fp);
+        fclose(fp);
+        return HTTP_OK;
+    }
+    switch (option)
+    {
+    case HTTP_OPTIONS_URL:
+        http->connection->url = tmp;
+        __parse_url(http, &http->connection->hostname,
+                    &http->connection->port, &http->connection->path, &http->connection->query);
+        if (!http->connection->hostname || !http->connection->port)
+        {
+            __set_error_msg(http, "Invalid URL");
+            http->error_code = HTTP_INVALID_URL;
+            return HTTP_ERROR;
+        }
+        break;
+    case HTTP_OPTIONS_HOSTNAME:
+        http->connection->hostname = strdup(tmp);
+        break;
+    case HTTP_OPTIONS_PORT:
+        http->connection->port = strdup(tmp);
+        break;
+    case HTTP_OPTIONS_PATH:
+        http->connection->path = strdup(tmp);
+        break;
+    case HTTP_OPTIONS_QUERY:
+        http->connection->query = strdup(tmp);
+        break;
+    case HTTP_OPTIONS_REQUEST_METHOD:
+        http->connection->method = (enum http_requests)val;
+        break;
+    case HTTP_OPTIONS_HEADERS:
+        http->connection->headers = strdup(tmp);
+        break;
+    case HTTP_OPTIONS_CONTENT_TYPE_HEADER:
+        http->connection->content_type = strdup(tmp);
+        break;
+    case HTTP_OPTIONS_HTTP_VERSION:
+        if ((long)val < HTTP_1_0 || (long)val > HTTP_2)
+        {
+            __set_error_msg(http, "Unsupported HTTP version %ld", (long)val);
+            http->error_code = HTTP_INVALID_OPTION;
+            return HTTP_ERROR;
+        }
+        http->connection->version = (enum http_version)val;
+        break;
+    case HTTP_OPTIONS_TLS_VERSION:
+        http->ssl.version = (enum http_tls_version)val;
+        break;
+    case HTTP_OPTIONS_KTLS:
+        http->ssl.ktls = (enum http_ktls)val;
+        break;
+    case HTTP_OPTIONS_ZEROCOPY:
+        http->zerocopy = (enum http_zerocopy)val;
+        break;
+    case HTTP_OPTIONS_BODY_FILE_MODE:
+        http->connection->file_mode = (enum http_body_file_mode)val;
+        break;
+    case HTTP_OPTIONS_BODY_READ_AHEAD:
+        http->connection->read_ahead = (int)(long)val;
+        break;
+    case HTTP_OPTIONS_REDIRECTS:
+        http->connection->redirects = (enum http_redirects)val;
+        break;
+    case HTTP_OPTIONS_MAX_REDIRECT:
+        http->connection->max_redirect = *val;
+        break;
+    case HTTP_OPTIONS_RESPONSE_TIMEOUT:
+        http->connection->res_timeout = *val;
+        // Handle
+        break;
+    case HTTP_OPTIONS_POST_BODY:
+    case HTTP_OPTIONS_PATCH_BODY:
+    case HTTP_OPTIONS_PUT_BODY:
+        return http_options_set_body(http, option, tmp, strlen(tmp));
+    case HTTP_OPTIONS_LOAD_COOKIES:
+        sprintf(http->connection->cookies, "%s", tmp);
+        break;
+    case HTTP_OPTIONS_VERBOSITY:
+        http->verbose = (enum http_verbosity)val;
+        break;
+    case HTTP_OPTIONS_LOGGING_FP:
+        http->lfp = (FILE *)value;
+        break;
+    case HTTP_OPTIONS_BODY_READ_CALLBACK:
+        http->connection->read_cb = (http_read_callback)value;
+        break;
+    case HTTP_OPTIONS_BODY_READ_DATA:
+        http->connection->read_data = (void *)value;
+        break;
+    case HTTP_OPTIONS_BODY_WRITE_CALLBACK:
+        http->connection->write_cb = (http_write_callback)value;
+        break;
+    case HTTP_OPTIONS_BODY_WRITE_DATA:
+        http->connection->write_data = (void *)value;
+        break;
+    case HTTP_OPTIONS_HEADER_CALLBACK:
+        http->connection->header_cb = (http_header_callback)value;
+        break;
+    case HTTP_OPTIONS_HEADER_DATA:
+        http->connection->header_data = (void *)value;
+        break;
+    case HTTP_OPTIONS_ABORT_DRAIN_LIMIT:
+        http->connection->drain_limit = (long)val;
+        break;
+    case HTTP_OPTIONS_BODY_SIZE:
+        http->connection->body_size = *(const long *)value;
+        http->connection->body_size_known = http->connection->body_size >= 0;
+        break;
+    case HTTP_OPTIONS_MIME:
+        http->connection->mime = (http_mime)value;
+        break;
+    case HTTP_OPTIONS_BODY_ENCODING:
+#ifndef LIBHTTP_WITH_ZSTD
+        if ((enum http_body_encoding)val == HTTP_BODY_ENCODING_ZSTD)
+        {
+            __set_error_msg(http, "libhttp was built without zstd");
+            http->error_code = HTTP_INVALID_OPTION;
+            return HTTP_ERROR;
+        }
+#endif
+        http->connection->encoding = (enum http_body_encoding)val;
+        break;
+    case HTTP_OPTIONS_BODY_ENCODING_LEVEL:
+        http->connection->encoding_level = (int)(long)val;
+        break;
+    case HTTP_OPTIONS_EXPECT_CONTINUE:
+        http->connection->expect_continue = (long)val;
+        break;
+    case HTTP_OPTIONS_EXPECT_CONTINUE_TIMEOUT:
+        http->connection->continue_timeout = (int)(long)val;
+        break;
+    case HTTP_OPTIONS_MAX_RESPONSE_SIZE:
+        http->connection->max_response = (long)val;
+        break;
+    case HTTP_OPTIONS_PROXY_URL:
+        http->connection->proxy.url = strdup(tmp);
+        __parse_proxy_url(http, &http->connection->proxy.hostname,
+                          &http->connection->proxy.port);
+        if (!http->connection->proxy.hostname || !http->connection->proxy.port)
+        {
+            __set_error_msg(http, "Invalid URL");
+            http->error_code = HTTP_INVALID_URL;
+            return HTTP_ERROR;
+        }
+        break;
+    case HTTP_OPTIONS_PROXY_HOSTNAME:
+        http->connection->proxy.hostname = strdup(tmp);
+        break;
+    case HTTP_OPTIONS_PROXY_PORT:
+        http->connection->proxy.port = strdup(tmp);
+        break;
+    case HTTP_OPTIONS_HEADERS_INCLUDE:
+        if (__header_list_parse(http, tmp) != HTTP_OK)
+            return HTTP_ERROR;
+        break;
+    case HTTP_OPTIONS_USER_AGENT:
+        http->connection->user_agent = strdup(tmp);
+        break;
+    case HTTP_OPTIONS_CONNECTION_HEADER:
+        http->connection->connection = strdup(tmp);
+        break;
+    default:
+        return HTTP_ERROR;
+    }
+
+    return HTTP_OK;
+}
+
+// Get an HTTP option and write it to value
+int http_options_get(http_session http, enum http_options option, char **value)
+{
+
+    switch (option)
+    {
+    case HTTP_OPTIONS_URL:
+        *value = http->connection->url;
+        break;
+    case HTTP_OPTIONS_HOSTNAME:
+        *value = http->connection->hostname;
+        break;
+    case HTTP_OPTIONS_PORT:
+        *value = http->connection->port;
+        break;
+    case HTTP_OPTIONS_PATH:
+        *value = http->connection->path;
+        break;
+    case HTTP_OPTIONS_QUERY:
+        *value = http->connection->query;
+        break;
+    case HTTP_OPTIONS_HEADERS:
+        *value = http->connection->headers;
+        break;
+    case HTTP_OPTIONS_POST_BODY:
+    case HTTP_OPTIONS_PATCH_BODY:
+    case HTTP_OPTIONS_PUT_BODY:
+        *value = __body_of(http->connection, option)->data;
+        break;
+    case HTTP_OPTIONS_CONTENT_TYPE_HEADER:
+        *value = http->connection->content_type;
+        break;
+    case HTTP_OPTIONS_LOAD_COOKIES:
+        *value = http->connection->cookies;
+        break;
+    case HTTP_OPTIONS_PROXY_URL:
+        *value = http->connection->proxy.url;
+        break;
+    case HTTP_OPTIONS_PROXY_HOSTNAME:
+        *value = http->connection->proxy.hostname;
+        break;
+    case HTTP_OPTIONS_PROXY_PORT:
+        *value = http->connection->proxy.port;
+        break;
+    default:
+        return HTTP_ERROR;
+    }
+
+    return HTTP_OK;
+}
+
+// Get request method
+int http_options_get_request_method(http_session http)
+{
+    if (http->connection->method < 1)
+        return HTTP_GET;
+    else
+        return http->connection->method;
+}
+
+// Get http version
+int http_options_get_http_version(http_session http)
+{
+    if (http->connection->version < 1)
+        return HTTP_1_1;
+    else
+        return http->connection->version;
+}
+int http_get_error_code(http_session http)
+{
+    return http->error_code;
 };
 // Get tls version
 int http_options_get_tls_version(http_session http)
@@ -770,762 +1769,1673 @@ int http_options_get_tls_version(http_session http)
     return http->ssl.version;
 }
 
-// Retrieve the HTTP connection socket
-HTTPSOCKET http_get_fd(http_session http)
+// Directions of the server connection handled by kernel TLS, HTTP_KTLS_TX | HTTP_KTLS_RX
+int __ktls_state(SSL *ssl)
+{
+    int state = 0;
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L && !defined(OPENSSL_NO_KTLS)
+    if (ssl && BIO_get_ktls_send(SSL_get_wbio(ssl)))
+        state |= HTTP_KTLS_TX;
+    if (ssl && BIO_get_ktls_recv(SSL_get_rbio(ssl)))
+        state |= HTTP_KTLS_RX;
+#endif
+    return state;
+}
+
+int http_get_ktls(http_session http)
+{
+    return __ktls_state(http->ssl.ssl);
+}
+
+// Ask OpenSSL to hand the record layer to the kernel after the handshake
+void __ktls_enable(http_session http, SSL_CTX *ctx)
+{
+#ifdef SSL_OP_ENABLE_KTLS
+    if (http->ssl.ktls == HTTP_KTLS_ENABLE)
+        SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS);
+#endif
+}
+
+// Retrieve the HTTP connection socket
+HTTPSOCKET http_get_fd(http_session http)
+{
+    return http->socket;
+}
+
+// Retrieve the HTTP proxy socket
+HTTPSOCKET http_get_proxy_fd(http_session http)
+{
+    return http->proxy_socket;
+}
+
+/* Precomputed request line tokens, indexed by enum http_requests / enum http_version */
+struct http_token
+{
+    const char *str;
+    size_t len;
+};
+
+# define HTTP_TOKEN(s) {s, sizeof(s) - 1}
+
+static const struct http_token http_method_tokens[] = {
+    [0] = HTTP_TOKEN("GET"),
+    [HTTP_GET] = HTTP_TOKEN("GET"),
+    [HTTP_POST] = HTTP_TOKEN("POST"),
+    [HTTP_PUT] = HTTP_TOKEN("PUT"),
+    [HTTP_PATCH] = HTTP_TOKEN("PATCH"),
+    [HTTP_HEAD] = HTTP_TOKEN("HEAD"),
+    [HTTP_OPTIONS] = HTTP_TOKEN("OPTIONS"),
+    [HTTP_DELETE] = HTTP_TOKEN("DELETE"),
+    [HTTP_TRACE] = HTTP_TOKEN("TRACE"),
+};
+
+static const struct http_token http_version_tokens[] = {
+    [0] = HTTP_TOKEN("HTTP/1.1"),
+    [HTTP_1_0] = HTTP_TOKEN("HTTP/1.0"),
+    [HTTP_1_1] = HTTP_TOKEN("HTTP/1.1"),
+    [HTTP_2] = HTTP_TOKEN("HTTP/2"),
+};
+
+const struct http_token *__method_token(enum http_requests method)
+{
+    if (method < 0 || method > HTTP_TRACE)
+        method = 0;
+    return &http_method_tokens[method];
+}
+
+const struct http_token *__version_token(enum http_version version)
+{
+    if (version < 0 || version > HTTP_2)
+        version = 0;
+    return &http_version_tokens[version];
+}
+
+/* Length tracking writer used to serialize requests into a sized buffer */
+struct http_writer
+{
+    char *buf;
+    size_t len;
+    size_t cap;
+    int overflow;
+};
+
+/**
+ * Append n bytes, flagging an overflow instead of writing past the buffer.
+ * A writer without a buffer only counts, which is used to size requests
+ */
+void __writer_put(struct http_writer *w, const char *data, size_t n)
+{
+    if (!w->buf)
+    {
+        w->len += n;
+        return;
+    }
+    if (w->overflow || n >= w->cap - w->len)
+    {
+        w->overflow = 1;
+        return;
+    }
+    memcpy(w->buf + w->len, data, n);
+    w->len += n;
+}
+
+# define __writer_lit(w, s) __writer_put((w), (s), sizeof(s) - 1)
+
+void __writer_str(struct http_writer *w, const char *str)
+{
+    if (str)
+        __writer_put(w, str, strlen(str));
+}
+
+void __writer_token(struct http_writer *w, const struct http_token *token)
+{
+    __writer_put(w, token->str, token->len);
+}
+
+// Append the decimal representation of value
+void __writer_size(struct http_writer *w, size_t value)
+{
+    char digits[24];
+    size_t i = sizeof(digits);
+    do
+    {
+        digits[--i] = '0' + value % 10;
+        value /= 10;
+    } while (value);
+    __writer_put(w, digits + i, sizeof(digits) - i);
+}
+
+// NUL terminate the output; returns HTTP_ERROR if anything didn't fit
+int __writer_finish(struct http_writer *w)
+{
+    if (w->buf)
+        w->buf[w->len] = 0;
+    return w->overflow ? HTTP_ERROR : HTTP_OK;
+}
+
+// Body options of the current method, NULL for methods without a body
+struct http_body *__method_body(http_session http)
+{
+    switch (http->connection->method)
+    {
+    case HTTP_POST:
+        return &http->connection->post_body;
+    case HTTP_PUT:
+        return &http->connection->put_body;
+    case HTTP_PATCH:
+        return &http->connection->patch_body;
+    default:
+        return NULL;
+    }
+}
+
+// Whether the body is produced at send time instead of living in memory
+int __body_streamed(http_session http)
+{
+    struct http_conn_info *c = http->connection;
+    struct http_body *b = __method_body(http);
+    return b && (c->mime || c->read_cb || b->file || c->encoding > HTTP_BODY_ENCODING_IDENTITY);
+}
+
+// Content-Encoding applied to the body, multipart forms are sent as is
+enum http_body_encoding __body_encoding(http_session http)
+{
+    struct http_conn_info *c = http->connection;
+    if (!__method_body(http) || c->mime || c->encoding < HTTP_BODY_ENCODING_GZIP)
+        return HTTP_BODY_ENCODING_IDENTITY;
+    return c->encoding;
+}
+
+// Request body of the current method, NULL for methods without a body
+const char *__request_body(http_session http, size_t *len)
+{
+    struct http_body *b = __method_body(http);
+    if (!b)
+    {
+        *len = 0;
+        return NULL;
+    }
+    *len = b->len;
+    return b->data ? b->data : "";
+}
+
+/**
+ * Size of the body to send, for Content-Length
+ * @returns 0 if the size isn't known up front and the body is sent chunked
+ */
+int __request_body_size(http_session http, long long *size)
+{
+    struct http_conn_info *c = http->connection;
+    struct http_body *b = __method_body(http);
+    if (c->mime)
+        return (*size = http_mime_size(c->mime)) >= 0;
+    // The compressed size is only known once it has been sent
+    if (__body_encoding(http) != HTTP_BODY_ENCODING_IDENTITY)
+    {
+        *size = -1;
+        return 0;
+    }
+    if (c->read_cb)
+        *size = c->body_size;
+    else if (b && b->file)
+        *size = b->file_size;
+    else
+        *size = b ? (long long)b->len : 0;
+    return *size >= 0 && (!c->read_cb || c->body_size_known);
+}
+
+// Whether the body waits for 100 Continue, HTTP/1.0 servers don't know Expect
+int __expect_continue(http_session http)
+{
+    struct http_conn_info *c = http->connection;
+    long long size;
+    if (c->expect_continue <= 0 || !__method_body(http) || c->version == HTTP_1_0)
+        return 0;
+    return !__request_body_size(http, &size) || size >= c->expect_continue;
+}
+
+// A default header is only written if the user hasn't set a field with the same name
+int __header_is_default(struct http_conn_info *c, const char *name, size_t name_len)
+{
+    return __header_list_find(&c->fields, name, name_len, 0) < 0;
+}
+
+# define __is_default(c, name) __header_is_default((c), (name), sizeof(name) - 1)
+
+/**
+ * Write the request line and headers
+ * When HTTP/2 is requested but not yet in use, an HTTP/1.1 upgrade
+ * request is produced instead.
+ */
+void __write_request_headers(http_session http, struct http_writer *w)
+{
+    struct http_conn_info *c = http->connection;
+    int upgrade = c->version == HTTP_2 && !c->http2InUse;
+
+    __writer_token(w, __method_token(c->method));
+    __writer_lit(w, " /");
+    __writer_str(w, c->path);
+    __writer_lit(w, " ");
+    __writer_token(w, upgrade ? __version_token(HTTP_1_1) : __version_token(c->version));
+    __writer_lit(w, "\r\n");
+
+    // If headers are already provided by the user
+    if (c->headers != NULL)
+    {
+        __writer_str(w, c->headers);
+        __writer_lit(w, "\r\n");
+        return;
+    }
+
+    if (__is_default(c, "Host"))
+    {
+        __writer_lit(w, "Host: ");
+        __writer_str(w, c->hostname);
+        __writer_lit(w, ":");
+        __writer_str(w, c->port);
+        __writer_lit(w, "\r\n");
+    }
+
+    if (__is_default(c, "User-Agent"))
+    {
+        __writer_lit(w, "User-Agent: ");
+        if (c->user_agent)
+            __writer_str(w, c->user_agent);
+        else
+            __writer_lit(w, LIBHTTP_USER_AGENT);
+        __writer_lit(w, "\r\n");
+    }
+
+    if (__is_default(c, "Accept"))
+        __writer_lit(w, "Accept: */*\r\n");
+
+    for (size_t i = 0; i < c->fields.count; i++)
+    {
+        struct http_header_field *f = &c->fields.fields[i];
+        __writer_put(w, f->name, f->name_len);
+        __writer_lit(w, ": ");
+        __writer_put(w, f->value, f->value_len);
+        __writer_lit(w, "\r\n");
+    }
+
+    if (c->cookies[0] && c->cookies[1])
+    {
+        __writer_lit(w, "Cookies: ");
+        __writer_str(w, c->cookies);
+        __writer_lit(w, "\r\n");
+    }
+
+    if (upgrade)
+    {
+        __writer_lit(w, "Connection: Upgrade, HTTP2-Settings\r\n");
+        if (http->flag == HTTPS)
+            __writer_lit(w, "Upgrade: h2\r\n");
+        else
+            __writer_lit(w, "Upgrade: h2c\r\n");
+        __writer_lit(w, "HTTP2-Settings: AAMAAABkAAQCAAAAAAIAAAAA\r\n");
+    }
+    else if (__is_default(c, "Connection"))
+    {
+        __writer_lit(w, "Connection: ");
+        if (c->connection)
+            __writer_str(w, c->connection);
+        else
+            __writer_lit(w, "close");
+        __writer_lit(w, "\r\n");
+    }
+
+    // Request body headers for POST, PUT and PATCH
+    if (__method_body(http))
+    {
+        long long body_size;
+        int sized = __request_body_size(http, &body_size);
+
+        if (__is_default(c, "Content-Type"))
+        {
+            __writer_lit(w, "Content-Type: ");
+            // The boundary has to match the one in the body
+            if (c->mime)
+                __writer_str(w, c->mime->content_type);
+            else if (c->content_type)
+                __writer_str(w, c->content_type);
+            else if (c->method == HTTP_POST)
+                __writer_lit(w, "application/x-www-form-urlencoded");
+            else
+                __writer_lit(w, "text/html");
+            __writer_lit(w, "\r\n");
+        }
+
+        enum http_body_encoding encoding = __body_encoding(http);
+        if (encoding != HTTP_BODY_ENCODING_IDENTITY && __is_default(c, "Content-Encoding"))
+        {
+            if (encoding == HTTP_BODY_ENCODING_GZIP)
+                __writer_lit(w, "Content-Encoding: gzip\r\n");
+            else
+                __writer_lit(w, "Content-Encoding: zstd\r\n");
+        }
+
+        if (__expect_continue(http) && __is_default(c, "Expect"))
+            __writer_lit(w, "Expect: 100-continue\r\n");
+
+        // A streamed body of unknown size is sent chunked
+        if (!sized)
+        {
+            if (__is_default(c, "Transfer-Encoding"))
+                __writer_lit(w, "Transfer-Encoding: chunked\r\n");
+        }
+        else if (__is_default(c, "Content-Length"))
+        {
+            __writer_lit(w, "Content-Length: ");
+            __writer_size(w, (size_t)body_size);
+            __writer_lit(w, "\r\n");
+        }
+    }
+    __writer_lit(w, "\r\n");
+}
+
+// Make sure the request buffer can hold size bytes
+int __reserve_request(http_session http, size_t size)
+{
+    if (http->req_cap >= size)
+        return HTTP_OK;
+
+    char *buf = (char *)realloc(http->req_headers, size);
+    if (!buf)
+    {
+        __set_error_msg(http, "%s", __get_error_msg());
+        http->error_code = errno;
+        return HTTP_ERROR;
+    }
+    http->req_headers = buf;
+    http->req_cap = size;
+    return HTTP_OK;
+}
+
+/**
+ * Construct the request headers
+ * A counting pass sizes the request exactly, then the request line and
+ * every header are written once into the session's request buffer.
+ */
+int __construct_request_headers(http_session http)
+{
+    struct http_writer w = {NULL, 0, 0, 0};
+
+    __write_request_headers(http, &w);
+    if (__reserve_request(http, w.len + 1) != HTTP_OK)
+        return HTTP_ERROR;
+
+    w.buf = http->req_headers;
+    w.len = 0;
+    w.cap = http->req_cap;
+    __write_request_headers(http, &w);
+
+    http->req_len = w.len;
+    return __writer_finish(&w);
+}
+
+/**
+ * Send len bytes on the server (flag == 0) or proxy (flag == 1) connection,
+ * retrying partial writes until everything is sent
+ */
+int __send_buffer(http_session http, int flag, const char *buf, size_t len)
+{
+    enum connection_protocol proto = flag ? http->proxy_flag : http->flag;
+    HTTPSOCKET sock = flag ? http->proxy_socket : http->socket;
+    SSL *ssl = flag ? http->ssl.proxy_ssl : http->ssl.ssl;
+
+    while (len > 0)
+    {
+        int n = len > INT_MAX ? INT_MAX : (int)len;
+        int bytes_sent;
+        if (proto == HTTPS)
+            bytes_sent = SSL_write(ssl, buf, n);
+        else
+            bytes_sent = send(sock, buf, n, 0);
+
+        if (bytes_sent < 1)
+        {
+            __set_error_msg(http, "unfinished request, connection reset by peer\n");
+            http->error_code = HTTP_CONNECTION_RESET;
+            return HTTP_ERROR;
+        }
+        buf += bytes_sent;
+        len -= bytes_sent;
+    }
+    return HTTP_OK;
+}
+
+// Print what was sent when verbosity is enabled
+void __log_sent(http_session http, const char *data, size_t len)
+{
+    if (http->verbose != HTTP_VERBOSITY_ENABLE)
+        return;
+
+    fprintf(stdout, "<| ");
+    for (size_t i = 0; i < len && data[i]; i++)
+    {
+        if (data[i] == '\n')
+            fprintf(stdout, "\n<| ");
+        else
+            fputc(data[i], stdout);
+    }
+    fprintf(stdout, "\n");
+    if (http->lfp != NULL)
+        fprintf(http->lfp, "%.*s", (int)len, data);
+}
+
+/**
+ * Stream a body from a read callback, HTTP_STREAM_CHUNK bytes at a time,
+ * each read framed as a chunk when chunked is set. A size of 0 or more is
+ * checked against what the callback produced. Every chunk is fully sent
+ * before the next one is read, so a slow peer blocks the callback and
+ * memory use stays constant.
+ */
+int __send_body_part(http_session http, int flag, http_read_callback read_cb,
+                     void *read_data, long long size, int chunked)
+{
+    // Room for the chunk size line in front of the data and CRLF after it
+    char *buf = (char *)malloc(16 + HTTP_STREAM_CHUNK + 2);
+    char *data = buf + 16;
+    long long sent = 0;
+    int ret = HTTP_OK;
+
+    if (!buf)
+    {
+        __set_error_msg(http, "%s", __get_error_msg());
+        http->error_code = errno;
+        return HTTP_ERROR;
+    }
+
+    for (;;)
+    {
+        size_t n = read_cb(data, HTTP_STREAM_CHUNK, read_data);
+        if (n == HTTP_READ_ABORT || n > HTTP_STREAM_CHUNK)
+        {
+            __set_error_msg(http, "Request body aborted by the read callback");
+            http->error_code = HTTP_ABORTED_BY_CALLBACK;
+            ret = HTTP_ERROR;
+            break;
+        }
+        if (n == 0)
+            break;
+
+        sent += n;
+        if (size >= 0 && sent > size)
+            break;
+        if (chunked)
+        {
+            char line[16];
+            int l = sprintf(line, "%zx\r\n", n);
+            memcpy(data - l, line, l);
+            memcpy(data + n, "\r\n", 2);
+            ret = __send_buffer(http, flag, data - l, l + n + 2);
+        }
+        else
+            ret = __send_buffer(http, flag, data, n);
+        if (ret != HTTP_OK)
+            break;
+        http->body_wire += n;
+    }
+    free(buf);
+
+    if (ret != HTTP_OK)
+        return HTTP_ERROR;
+    if (size >= 0 && sent != size)
+    {
+        __set_error_msg(http, "Streamed body size differs from the declared %lld bytes", size);
+        http->error_code = HTTP_BODY_SIZE_MISMATCH;
+        return HTTP_ERROR;
+    }
+    return HTTP_OK;
+}
+
+// Stream a whole body from a read callback, chunked when size is negative
+int __send_body_from(http_session http, int flag, http_read_callback read_cb,
+                     void *read_data, long long size)
+{
+    if (__send_body_part(http, flag, read_cb, read_data, size, size < 0) != HTTP_OK)
+        return HTTP_ERROR;
+    if (size < 0)
+        return __send_buffer(http, flag, "0\r\n\r\n", 5);
+    return HTTP_OK;
+}
+
+// Read callback over a file descriptor
+size_t __fd_read(char *buf, size_t size, void *userdata)
+{
+    int fd = *(int *)userdata;
+    long n;
+    do
+        n = read(fd, buf, size);
+    while (n < 0 && errno == EINTR);
+    return n < 0 ? HTTP_READ_ABORT : (size_t)n;
+}
+
+/**
+ * Send size bytes of fd without copying them through user space when the
+ * connection allows it: sendfile() for plain HTTP, SSL_sendfile() when kTLS
+ * handles the TLS records.
+ * @returns HTTP_OK, HTTP_ERROR, or 1 if nothing was sent and the caller should copy
+ */
+int __send_file_zero_copy(http_session http, int flag, int fd, long long size)
+{
+    enum connection_protocol proto = flag ? http->proxy_flag : http->flag;
+    HTTPSOCKET sock = flag ? http->proxy_socket : http->socket;
+    SSL *ssl = flag ? http->ssl.proxy_ssl : http->ssl.ssl;
+    long long off = 0;
+
+    if (proto == HTTPS)
+    {
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L && !defined(OPENSSL_NO_KTLS)
+        if (!BIO_get_ktls_send(SSL_get_wbio(ssl)))
+            return 1;
+        while (off < size)
+        {
+            size_t n = size - off > INT_MAX ? INT_MAX : (size_t)(size - off);
+            ossl_ssize_t r = SSL_sendfile(ssl, fd, (off_t)off, n, 0);
+            if (r <= 0)
+                break;
+            off += r;
+        }
+#else
+        return 1;
+#endif
+    }
+    else
+    {
+#if defined(__linux__)
+        off_t pos = 0;
+        while (off < size)
+        {
+            size_t n = size - off > INT_MAX ? INT_MAX : (size_t)(size - off);
+            ssize_t r = sendfile(sock, fd, &pos, n);
+            if (r < 0 && errno == EINTR)
+                continue;
+            if (r < 0 && off == 0 && (errno == EINVAL || errno == ENOSYS))
+                return 1;
+            if (r <= 0)
+                break;
+            off += r;
+        }
+#else
+        return 1;
+#endif
+    }
+
+    if (off != size)
+    {
+        __set_error_msg(http, "unfinished request, connection reset by peer\n");
+        http->error_code = HTTP_CONNECTION_RESET;
+        return HTTP_ERROR;
+    }
+    return HTTP_OK;
+}
+
+/**
+ * Send size bytes of fd straight from a mapping of the file, HTTP_MMAP_WINDOW
+ * bytes at a time so only one window is mapped and resident at once
+ * @returns HTTP_OK, HTTP_ERROR, or 1 if the file can't be mapped
+ */
+int __send_file_mmap(http_session http, int flag, int fd, long long size)
 {
-    return http->socket;
+#if !defined(_WIN32)
+    long long off = 0;
+    while (off < size)
+    {
+        size_t n = size - off > HTTP_MMAP_WINDOW ? HTTP_MMAP_WINDOW : (size_t)(size - off);
+        void *map = mmap(NULL, n, PROT_READ, MAP_SHARED, fd, (off_t)off);
+        if (map == MAP_FAILED)
+        {
+            if (off == 0)
+                return 1;
+            __set_error_msg(http, "%s", __get_error_msg());
+            http->error_code = errno;
+            return HTTP_ERROR;
+        }
+        madvise(map, n, MADV_SEQUENTIAL | MADV_WILLNEED);
+        int ret = __send_buffer(http, flag, (const char *)map, n);
+        munmap(map, n);
+        if (ret != HTTP_OK)
+            return HTTP_ERROR;
+        off += n;
+    }
+    return HTTP_OK;
+#else
+    return 1;
+#endif
 }
 
-// Retrieve the HTTP proxy socket
-HTTPSOCKET http_get_proxy_fd(http_session http)
+#ifdef HTTP_HAVE_READAHEAD
+/* A ring of buffers a reader thread fills while the sender sends the previous ones */
+struct http_readahead
 {
-    return http->proxy_socket;
-}
+    int fd;
+    int depth;
+    char *bufs[HTTP_READ_AHEAD_MAX];
+    long lens[HTTP_READ_AHEAD_MAX]; // bytes read, 0 at the end of the file, -1 on error
+    int head;                       // next buffer to send
+    int count;                      // buffers read and not sent yet
+    int stop;
+    int error; // errno of the failed read
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+};
 
-void __request_http2(http_session http)
+void *__readahead_main(void *arg)
 {
+    struct http_readahead *ra = (struct http_readahead *)arg;
+    int tail = 0;
 
-    switch (http->connection.method)
+    for (;;)
     {
-    case HTTP_GET:
-        sprintf(http->connection.req_headers, "GET /%s HTTP/1.1\r\n", http->connection.path);
-        break;
+        pthread_mutex_lock(&ra->lock);
+        while (ra->count == ra->depth && !ra->stop)
+            pthread_cond_wait(&ra->cond, &ra->lock);
+        int stop = ra->stop;
+        pthread_mutex_unlock(&ra->lock);
+        if (stop)
+            break;
 
-    case HTTP_POST:
-        sprintf(http->connection.req_headers, "POST /%s HTTP/1.1\r\n", http->connection.path);
-        break;
-    case HTTP_PUT:
-        sprintf(http->connection.req_headers, "PUT /%s HTTP/1.1\r\n", http->connection.path);
-        break;
-    case HTTP_PATCH:
-        sprintf(http->connection.req_headers, "PATCH /%s HTTP/1.1\r\n", http->connection.path);
-        break;
-    case HTTP_HEAD:
-        sprintf(http->connection.req_headers, "HEAD /%s HTTP/1.1\r\n", http->connection.path);
-        break;
-    case HTTP_OPTIONS:
-        sprintf(http->connection.req_headers, "OPTIONS /%s HTTP/1.1\r\n", http->connection.path);
-        break;
-    case HTTP_DELETE:
-        sprintf(http->connection.req_headers, "DELETE /%s HTTP/1.1\r\n", http->connection.path);
-        break;
-    case HTTP_TRACE:
-        sprintf(http->connection.req_headers, "TRACE /%s HTTP/1.1\r\n", http->connection.path);
-        break;
-    default:
-        sprintf(http->connection.req_headers, "GET /%s HTTP/1.1\r\n", http->connection.path);
-        break;
+        // The sender never touches a buffer that isn't counted as read
+        size_t n = __fd_read(ra->bufs[tail], HTTP_STREAM_CHUNK, &ra->fd);
+
+        pthread_mutex_lock(&ra->lock);
+        ra->error = errno;
+        ra->lens[tail] = n == HTTP_READ_ABORT ? -1 : (long)n;
+        ra->count++;
+        pthread_cond_signal(&ra->cond);
+        pthread_mutex_unlock(&ra->lock);
+        if (n == 0 || n == HTTP_READ_ABORT)
+            break;
+        tail = (tail + 1) % ra->depth;
     }
+    return NULL;
+}
 
-    // If headers are already provided by the user
-    if (http->connection.headers != NULL)
+/**
+ * Send size bytes of fd while a helper thread reads up to depth buffers
+ * ahead, so disk reads overlap with encryption and sending
+ * @returns HTTP_OK, HTTP_ERROR, or 1 if the pipeline couldn't be set up
+ */
+int __send_file_readahead(http_session http, int flag, int fd, long long size, int depth)
+{
+    struct http_readahead ra;
+    pthread_t reader;
+    long long sent = 0;
+    int ret = HTTP_OK, i;
+
+    memset(&ra, 0, sizeof(ra));
+    ra.fd = fd;
+    ra.depth = depth > HTTP_READ_AHEAD_MAX ? HTTP_READ_AHEAD_MAX : depth;
+    for (i = 0; i < ra.depth; i++)
+        if (!(ra.bufs[i] = (char *)malloc(HTTP_STREAM_CHUNK)))
+            break;
+    if (i < ra.depth)
     {
-        sprintf(http->connection.req_headers + strlen(http->connection.req_headers), "%s", http->connection.headers);
+        while (i--)
+            free(ra.bufs[i]);
+        return 1;
     }
-    else
-    {
-
-        sprintf(http->connection.req_headers + strlen(http->connection.req_headers), "Host: %s:%s\r\n",
-                http->connection.hostname, http->connection.port);
+    pthread_mutex_init(&ra.lock, NULL);
+    pthread_cond_init(&ra.cond, NULL);
+    if (pthread_create(&reader, NULL, __readahead_main, &ra) != 0)
+        ret = 1;
 
-        if (http->connection.user_agent)
-            sprintf(http->connection.req_headers + strlen(http->connection.req_headers), "User-Agent: %s\r\n", http->connection.user_agent);
-        else
-
-            sprintf(http->connection.req_headers + strlen(http->connection.req_headers),
-                    "User-Agent: libhttp(nshell)/%s\r\n", libhttp_get_version());
+    while (ret == HTTP_OK)
+    {
+        pthread_mutex_lock(&ra.lock);
+        while (ra.count == 0)
+            pthread_cond_wait(&ra.cond, &ra.lock);
+        long n = ra.lens[ra.head];
+        pthread_mutex_unlock(&ra.lock);
 
-        sprintf(http->connection.req_headers + strlen(http->connection.req_headers),
-                "Connection: Upgrade, HTTP2-Settings\r\n");
+        if (n < 0)
+        {
+            __set_error_msg(http, "%s", strerror(ra.error));
+            http->error_code = ra.error;
+            ret = HTTP_ERROR;
+        }
+        if (n <= 0 || (sent += n) > size)
+            break;
+        if (__send_buffer(http, flag, ra.bufs[ra.head], n) != HTTP_OK)
+            ret = HTTP_ERROR;
+
+        pthread_mutex_lock(&ra.lock);
+        ra.head = (ra.head + 1) % ra.depth;
+        ra.count--;
+        pthread_cond_signal(&ra.cond);
+        pthread_mutex_unlock(&ra.lock);
+    }
 
-        if (http->flag == HTTPS)
-            sprintf(http->connection.req_headers + strlen(http->connection.req_headers),
-                    "Upgrade: h2\r\n");
-        else
-            sprintf(http->connection.req_headers + strlen(http->connection.req_headers),
-                    "Upgrade: h2c\r\n");
+    if (ret != 1)
+    {
+        // The reader may be waiting for a free buffer
+        pthread_mutex_lock(&ra.lock);
+        ra.stop = 1;
+        pthread_cond_signal(&ra.cond);
+        pthread_mutex_unlock(&ra.lock);
+        pthread_join(reader, NULL);
+    }
+    pthread_cond_destroy(&ra.cond);
+    pthread_mutex_destroy(&ra.lock);
+    for (i = 0; i < ra.depth; i++)
+        free(ra.bufs[i]);
+
+    if (ret != HTTP_OK || sent == size)
+        return ret;
+    __set_error_msg(http, "Body file size changed from %lld bytes", size);
+    http->error_code = HTTP_BODY_SIZE_MISMATCH;
+    return HTTP_ERROR;
+}
+#endif
 
-        sprintf(http->connection.req_headers + strlen(http->connection.req_headers),
-                "HTTP2-Settings: AAMAAABkAAQCAAAAAAIAAAAA\r\n");
-        sprintf(http->connection.req_headers + strlen(http->connection.req_headers),
-                "accept: */*\r\n");
+/**
+ * Send size bytes of fd (-1 for everything up to EOF) through the fastest
+ * path the connection allows. With chunked set the data is framed as chunks,
+ * a file of known size as a single one so it can still go out zero-copy.
+ */
+int __send_fd_body(http_session http, int flag, int fd, long long size, int chunked)
+{
+    int ret = 1;
+    if (chunked && size > 0)
+    {
+        char line[24];
+        int l = sprintf(line, "%llx\r\n", size);
+        if (__send_buffer(http, flag, line, l) != HTTP_OK ||
+            __send_fd_body(http, flag, fd, size, 0) != HTTP_OK)
+            return HTTP_ERROR;
+        return __send_buffer(http, flag, "\r\n", 2);
+    }
 
-        if (http->connection.include_headers)
-        {
+    if (size > 0 && http->connection->file_mode == HTTP_BODY_FILE_MMAP)
+        ret = __send_file_mmap(http, flag, fd, size);
+    else if (size >= 0 && !chunked)
+        ret = __send_file_zero_copy(http, flag, fd, size);
+#ifdef HTTP_HAVE_READAHEAD
+    if (ret == 1 && size >= 0 && !chunked && http->connection->read_ahead >= 2)
+        ret = __send_file_readahead(http, flag, fd, size, http->connection->read_ahead);
+#endif
+    if (ret == HTTP_OK)
+        http->body_wire += size;
+    // Pipes and files that can't be sent otherwise are read
+    if (ret == 1)
+        ret = __send_body_part(http, flag, __fd_read, &fd, size, chunked);
+    return ret;
+}
 
-            if (strstr(http->connection.include_headers, "\n"))
-            {
+// Stream a body file, the request headers already announced its size
+int __send_body_file(http_session http, int flag, struct http_body *b)
+{
+    struct stat st;
+    int ret;
+    int fd = open(b->file, O_RDONLY);
+    if (fd < 0)
+    {
+        __set_error_msg(http, "%s", __get_error_msg());
+        http->error_code = errno;
+        return HTTP_ERROR;
+    }
 
-                sprintf(http->connection.req_headers + strlen(http->connection.req_headers),
-                        "%s\r\n", http->connection.include_headers);
-            }
-            else
-                sprintf(http->connection.req_headers + strlen(http->connection.req_headers),
-                        "%s\r\n", http->connection.include_headers);
-        }
+    // Content-Length went out with the headers, the file must still match it
+    if (b->file_size >= 0 && (fstat(fd, &st) != 0 || st.st_size != b->file_size))
+    {
+        close(fd);
+        __set_error_msg(http, "Body file size changed from %lld bytes", b->file_size);
+        http->error_code = HTTP_BODY_SIZE_MISMATCH;
+        return HTTP_ERROR;
+    }
 
-        if (strlen(http->connection.cookies) > 1)
+    ret = __send_fd_body(http, flag, fd, b->file_size, b->file_size < 0);
+    close(fd);
+    if (ret == HTTP_OK && b->file_size < 0)
+        ret = __send_buffer(http, flag, "0\r\n\r\n", 5);
+    return ret;
+}
 
-            sprintf(http->connection.req_headers + strlen(http->connection.req_headers), "Cookies: %s\r\n",
-                    http->connection.cookies);
+// Disable Nagle, requests are written in as few calls as possible anyway
+void __tcp_nodelay(HTTPSOCKET s)
+{
+    int one = 1;
+    setsockopt(s, IPPROTO_TCP, TCP_NODELAY, (char *)&one, sizeof(one));
+}
 
-        sprintf(http->connection.req_headers + strlen(http->connection.req_headers), "\r\n");
-    }
+// While corked, the kernel only sends full segments
+void __tcp_cork(HTTPSOCKET s, int on)
+{
+#if defined(TCP_CORK)
+    setsockopt(s, IPPROTO_TCP, TCP_CORK, (char *)&on, sizeof(on));
+#endif
 }
 
-void __construct_h2_request_headers(http_session http)
+#if !defined(_WIN32)
+// Send two buffers with one writev(), retrying partial writes
+int __send_iov(http_session http, HTTPSOCKET sock, const char *a, size_t alen,
+               const char *b, size_t blen)
 {
+    struct iovec iov[2] = {{(void *)a, alen}, {(void *)b, blen}};
+    struct iovec *v = iov;
+    int n = blen ? 2 : 1;
 
-    switch (http->connection.method)
+    while (n > 0)
     {
-    case HTTP_GET:
-        sprintf(http->connection.req_headers, "GET /%s HTTP/2\r\n", http->connection.path);
-        break;
-
-    case HTTP_POST:
-        sprintf(http->connection.req_headers, "POST /%s HTTP/2\r\n", http->connection.path);
-        break;
-    case HTTP_PUT:
-        sprintf(http->connection.req_headers, "PUT /%s HTTP/2\r\n", http->connection.path);
-        break;
-    case HTTP_PATCH:
-        sprintf(http->connection.req_headers, "PATCH /%s HTTP/2\r\n", http->connection.path);
-        break;
-    case HTTP_HEAD:
-        sprintf(http->connection.req_headers, "HEAD /%s HTTP/2\r\n", http->connection.path);
-        break;
-    case HTTP_OPTIONS:
-        sprintf(http->connection.req_headers, "OPTIONS /%s HTTP/2\r\n", http->connection.path);
-        break;
-    case HTTP_DELETE:
-        sprintf(http->connection.req_headers, "DELETE /%s HTTP/2\r\n", http->connection.path);
-        break;
-    case HTTP_TRACE:
-        sprintf(http->connection.req_headers, "TRACE /%s HTTP/2\r\n", http->connection.path);
-        break;
-    default:
-        sprintf(http->connection.req_headers, "GET /%s HTTP/2\r\n", http->connection.path);
-        break;
+        ssize_t r = writev(sock, v, n);
+        if (r < 0 && errno == EINTR)
+            continue;
+        if (r < 1)
+        {
+            __set_error_msg(http, "unfinished request, connection reset by peer\n");
+            http->error_code = HTTP_CONNECTION_RESET;
+            return HTTP_ERROR;
+        }
+        while (n > 0 && (size_t)r >= v->iov_len)
+        {
+            r -= v->iov_len;
+            v++;
+            n--;
+        }
+        if (n > 0)
+        {
+            v->iov_base = (char *)v->iov_base + r;
+            v->iov_len -= r;
+        }
     }
+    return HTTP_OK;
+}
+#endif
 
-    // If headers are already provided by the user
-    if (http->connection.headers != NULL)
+/**
+ * A request was cut off after some of it went out, or the kernel may still
+ * be reading the caller's pages: reset the connection so the server can't
+ * take what follows as part of it, and the unsent data is dropped
+ */
+void __connection_abort(http_session http, int flag)
+{
+    if (!(flag ? http->proxy_connected : http->connected))
+        return;
+    HTTPSOCKET sock = flag ? http->proxy_socket : http->socket;
+    struct linger l = {1, 0};
+    shutdown(sock, SHUT_RDWR);
+    setsockopt(sock, SOL_SOCKET, SO_LINGER, (const char *)&l, sizeof(l));
+    if (flag)
     {
-        sprintf(http->connection.req_headers + strlen(http->connection.req_headers), "%s", http->connection.headers);
+        http_proxy_disconnect(http);
+        http->proxy_connected = 0;
     }
     else
     {
+        http_disconnect(http);
+        http->connected = 0;
+    }
+}
 
-        sprintf(http->connection.req_headers + strlen(http->connection.req_headers), "Host: %s:%s\r\n",
-                http->connection.hostname, http->connection.port);
-
-        if (http->connection.user_agent)
-            sprintf(http->connection.req_headers + strlen(http->connection.req_headers), "user-agent: %s\r\n", http->connection.user_agent);
-        else
-
-            sprintf(http->connection.req_headers + strlen(http->connection.req_headers),
-                    "user-agent: libhttp(nshell)/%s\r\n", libhttp_get_version());
-
-        sprintf(http->connection.req_headers + strlen(http->connection.req_headers),
-                "connection: close\r\n");
+#ifdef HTTP_HAVE_ZEROCOPY
+/**
+ * Reap MSG_ZEROCOPY completions from the socket error queue, waiting up to
+ * timeout_ms for the first one
+ * @returns the number of sends the kernel is done with, -1 on error
+ */
+long __zerocopy_reap(HTTPSOCKET sock, int timeout_ms)
+{
+    struct pollfd p = {sock, 0, 0};
+    long done = 0;
 
-        sprintf(http->connection.req_headers + strlen(http->connection.req_headers),
-                "accept: */*\r\n");
+    // An empty events mask still reports POLLERR, raised by a pending completion
+    if (poll(&p, 1, timeout_ms) < 1)
+        return 0;
 
-        if (http->connection.include_headers)
+    for (;;)
+    {
+        char control[128];
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        if (recvmsg(sock, &msg, MSG_ERRQUEUE) < 0)
+            return errno == EAGAIN || errno == EWOULDBLOCK ? done : -1;
+
+        for (struct cmsghdr *cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm))
         {
-
-            if (strstr(http->connection.include_headers, "\n"))
-            {
-
-                sprintf(http->connection.req_headers + strlen(http->connection.req_headers),
-                        "%s\r\n", http->connection.include_headers);
-            }
-            else
-                sprintf(http->connection.req_headers + strlen(http->connection.req_headers),
-                        "%s\r\n", http->connection.include_headers);
+            if (!(cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR) &&
+                !(cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR))
+                continue;
+            struct sock_extended_err *ee = (struct sock_extended_err *)CMSG_DATA(cm);
+            if (ee->ee_origin == SO_EE_ORIGIN_ZEROCOPY)
+                done += ee->ee_data - ee->ee_info + 1;
         }
-
-        if (strlen(http->connection.cookies) > 1)
-
-            sprintf(http->connection.req_headers + strlen(http->connection.req_headers), "cookies: %s\r\n",
-                    http->connection.cookies);
-
-        sprintf(http->connection.req_headers + strlen(http->connection.req_headers), "\r\n");
     }
 }
 
-// Construct the request headers
-void __construct_request_headers(http_session http)
+/**
+ * Send a buffer with MSG_ZEROCOPY, the kernel transmits straight from the
+ * caller's pages. Returns only once every completion has been reaped, so the
+ * buffer can be reused or freed afterwards. When that can't be confirmed the
+ * connection is reset and the session disconnected.
+ * @returns HTTP_OK, HTTP_ERROR, or 1 if the socket doesn't support zerocopy
+ */
+int __send_zerocopy(http_session http, int flag, const char *buf, size_t len)
 {
+    HTTPSOCKET sock = flag ? http->proxy_socket : http->socket;
+    int one = 1;
+    int r = http->connection->res_timeout;
+    int timeout_ms = (int)((r >= 1 ? r : RES_TIMEOUT) * 1000);
+    long pending = 0, done;
 
-    if (http->connection.version == HTTP_2 && !http->connection.http2InUse)
-    {
-        __request_http2(http);
-        return;
-    }
-    switch (http->connection.method)
+    if (setsockopt(sock, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) != 0)
+        return 1;
+
+    while (len > 0)
     {
-    case HTTP_GET:
-        switch (http->connection.version)
-        {
-        case HTTP_1_0:
-            sprintf(http->connection.req_headers, "GET /%s HTTP/1.0\r\n", http->connection.path);
-            break;
-        case HTTP_1_1:
-            sprintf(http->connection.req_headers, "GET /%s HTTP/1.1\r\n", http->connection.path);
-            break;
-        case HTTP_2:
-            sprintf(http->connection.req_headers, "GET /%s HTTP/2\r\n", http->connection.path);
-            break;
-        default:
-            sprintf(http->connection.req_headers, "GET /%s HTTP/1.1\r\n", http->connection.path);
-            break;
-        }
-        break;
-    case HTTP_POST:
-        switch (http->connection.version)
-        {
-        case HTTP_1_0:
-            sprintf(http->connection.req_headers, "POST /%s HTTP/1.0\r\n", http->connection.path);
-            break;
-        case HTTP_1_1:
-            sprintf(http->connection.req_headers, "POST /%s HTTP/1.1\r\n", http->connection.path);
-            break;
-        case HTTP_2:
-            sprintf(http->connection.req_headers, "POST /%s HTTP/2\r\n", http->connection.path);
-            break;
-        default:
-            sprintf(http->connection.req_headers, "POST /%s HTTP/1.1\r\n", http->connection.path);
-            break;
-        }
-        break;
-    case HTTP_PUT:
-        switch (http->connection.version)
-        {
-        case HTTP_1_0:
-            sprintf(http->connection.req_headers, "PUT /%s HTTP/1.0\r\n", http->connection.path);
-            break;
-        case HTTP_1_1:
-            sprintf(http->connection.req_headers, "PUT /%s HTTP/1.1\r\n", http->connection.path);
-            break;
-        case HTTP_2:
-            sprintf(http->connection.req_headers, "PUT /%s HTTP/2\r\n", http->connection.path);
-            break;
-        default:
-            sprintf(http->connection.req_headers, "PUT /%s HTTP/1.1\r\n", http->connection.path);
-            break;
-        }
-        break;
-    case HTTP_HEAD:
-        switch (http->connection.version)
-        {
-        case HTTP_1_0:
-            sprintf(http->connection.req_headers, "HEAD /%s HTTP/1.0\r\n", http->connection.path);
-            break;
-        case HTTP_1_1:
-            sprintf(http->connection.req_headers, "HEAD /%s HTTP/1.1\r\n", http->connection.path);
-            break;
-        case HTTP_2:
-            sprintf(http->connection.req_headers, "HEAD /%s HTTP/2\r\n", http->connection.path);
-            break;
-        default:
-            sprintf(http->connection.req_headers, "HEAD /%s HTTP/1.1\r\n", http->connection.path);
-            break;
-        }
-        break;
-    case HTTP_DELETE:
-        switch (http->connection.version)
-        {
-        case HTTP_1_0:
-            sprintf(http->connection.req_headers, "DELETE /%s HTTP/1.0\r\n", http->connection.path);
-            break;
-        case HTTP_1_1:
-            sprintf(http->connection.req_headers, "DELETE /%s HTTP/1.1\r\n", http->connection.path);
-            break;
-        case HTTP_2:
-            sprintf(http->connection.req_headers, "DELETE /%s HTTP/2\r\n", http->connection.path);
-            break;
-        default:
-            sprintf(http->connection.req_headers, "DELETE /%s HTTP/1.1\r\n", http->connection.path);
-            break;
-        }
-        break;
-    case HTTP_TRACE:
-        switch (http->connection.version)
-        {
-        case HTTP_1_0:
-            sprintf(http->connection.req_headers, "TRACE /%s HTTP/1.0\r\n", http->connection.path);
-            break;
-        case HTTP_1_1:
-            sprintf(http->connection.req_headers, "TRACE /%s HTTP/1.1\r\n", http->connection.path);
-            break;
-        case HTTP_2:
-            sprintf(http->connection.req_headers, "TRACE /%s HTTP/2\r\n", http->connection.path);
-            break;
-        default:
-            sprintf(http->connection.req_headers, "TRACE /%s HTTP/1.1\r\n", http->connection.path);
-            break;
-        }
-        break;
-    case HTTP_PATCH:
-        switch (http->connection.version)
+        ssize_t n = send(sock, buf, len, MSG_ZEROCOPY);
+        if (n < 0 && errno == EINTR)
+            continue;
+        // Out of pinned memory, wait for the kernel to release earlier sends
+        if (n < 0 && errno == ENOBUFS && pending > 0 &&
+            (done = __zerocopy_reap(sock, timeout_ms)) > 0)
         {
-        case HTTP_1_0:
-            sprintf(http->connection.req_headers, "PATCH /%s HTTP/1.0\r\n", http->connection.path);
-            break;
-        case HTTP_1_1:
-            sprintf(http->connection.req_headers, "PATCH /%s HTTP/1.1\r\n", http->connection.path);
-            break;
-        case HTTP_2:
-            sprintf(http->connection.req_headers, "PATCH /%s HTTP/2\r\n", http->connection.path);
-            break;
-        default:
-            sprintf(http->connection.req_headers, "PATCH /%s HTTP/1.1\r\n", http->connection.path);
-            break;
+            pending -= done;
+            continue;
         }
-        break;
-    case HTTP_OPTIONS:
-        switch (http->connection.version)
+        if (n < 1)
         {
-        case HTTP_1_0:
-            sprintf(http->connection.req_headers, "OPTIONS /%s HTTP/1.0\r\n", http->connection.path);
-            break;
-        case HTTP_1_1:
-            sprintf(http->connection.req_headers, "OPTIONS /%s HTTP/1.1\r\n", http->connection.path);
-            break;
-        case HTTP_2:
-            sprintf(http->connection.req_headers, "OPTIONS /%s HTTP/2\r\n", http->connection.path);
-            break;
-        default:
-            sprintf(http->connection.req_headers, "OPTIONS /%s HTTP/1.1\r\n", http->connection.path);
-            break;
+            if (pending > 0)
+                __connection_abort(http, flag);
+            __set_error_msg(http, "unfinished request, connection reset by peer");
+            http->error_code = HTTP_CONNECTION_RESET;
+            return HTTP_ERROR;
         }
-        break;
-    default:
-        switch (http->connection.version)
+        pending++;
+        buf += n;
+        len -= n;
+    }
+
+    while (pending > 0)
+    {
+        if ((done = __zerocopy_reap(sock, timeout_ms)) <= 0)
         {
-        case HTTP_1_0:
-            sprintf(http->connection.req_headers, "GET /%s HTTP/1.0\r\n", http->connection.path);
-            break;
-        case HTTP_1_1:
-            sprintf(http->connection.req_headers, "GET /%s HTTP/1.1\r\n", http->connection.path);
-            break;
-        case HTTP_2:
-            sprintf(http->connection.req_headers, "GET /%s HTTP/2\r\n", http->connection.path);
-            break;
-        default:
-            sprintf(http->connection.req_headers, "GET /%s HTTP/1.1\r\n", http->connection.path);
-            break;
+            __connection_abort(http, flag);
+            __set_error_msg(http, "Timed out waiting for the kernel to release the request body, "
+                                  "the connection was reset and closed");
+            http->error_code = HTTP_RES_TIMEOUT;
+            return HTTP_ERROR;
         }
-        break;
+        pending -= done;
     }
-    // If headers are already provided by the user
-    if (http->connection.headers != NULL)
+    return HTTP_OK;
+}
+#endif
+
+// Send len bytes from memory, framed as one chunk when chunked
+int __send_chunk(http_session http, int flag, const char *data, size_t len, int chunked)
+{
+    if (len == 0)
+        return HTTP_OK;
+    http->body_wire += len;
+    if (!chunked)
+        return __send_buffer(http, flag, data, len);
+
+    char *buf = (char *)malloc(len + 24);
+    if (!buf)
     {
-        sprintf(http->connection.req_headers + strlen(http->connection.req_headers), "%s", http->connection.headers);
+        __set_error_msg(http, "%s", __get_error_msg());
+        http->error_code = errno;
+        return HTTP_ERROR;
     }
-    else
-    {
-        sprintf(http->connection.req_headers + strlen(http->connection.req_headers), "Host: %s:%s\r\n",
-                http->connection.hostname, http->connection.port);
-
-        if (http->connection.user_agent)
-            sprintf(http->connection.req_headers + strlen(http->connection.req_headers), "User-Agent: %s\r\n", http->connection.user_agent);
+    int l = sprintf(buf, "%zx\r\n", len);
+    memcpy(buf + l, data, len);
+    memcpy(buf + l + len, "\r\n", 2);
+    int ret = __send_buffer(http, flag, buf, l + len + 2);
+    free(buf);
+    return ret;
+}
 
-        else
-            sprintf(http->connection.req_headers + strlen(http->connection.req_headers),
-                    "User-Agent: libhttp(nshell)/%s\r\n", libhttp_get_version());
+// Send the contents of a file part, the caller's descriptors from the start
+int __send_mime_file(http_session http, int flag, struct http_mime_part *p, int chunked)
+{
+    struct stat st;
+    int fd = p->path ? open(p->path, O_RDONLY) : p->fd;
+    int ret;
+    if (fd < 0)
+    {
+        __set_error_msg(http, "%s", __get_error_msg());
+        http->error_code = errno;
+        return HTTP_ERROR;
+    }
 
-        sprintf(http->connection.req_headers + strlen(http->connection.req_headers),
-                "Accept: */*\r\n");
+    if (p->size >= 0 && (fstat(fd, &st) != 0 || st.st_size != p->size ||
+                         lseek(fd, 0, SEEK_SET) != 0))
+    {
+        __set_error_msg(http, "Form file size changed from %lld bytes", p->size);
+        http->error_code = HTTP_BODY_SIZE_MISMATCH;
+        ret = HTTP_ERROR;
+    }
+    else
+        ret = __send_fd_body(http, flag, fd, p->size, chunked);
 
-        if (http->connection.include_headers)
-        {
+    if (p->path)
+        close(fd);
+    return ret;
+}
 
-            if (strstr(http->connection.include_headers, "\n"))
-            {
+/**
+ * Stream a multipart/form-data body part by part. Heads and field values
+ * go out from memory, file parts through __send_fd_body() so they keep the
+ * zero-copy paths, and callback parts as they are read.
+ */
+int __send_mime(http_session http, int flag, http_mime mime)
+{
+    int chunked = http_mime_size(mime) < 0;
+    char end[sizeof(mime->boundary) + 8];
+    int ret = HTTP_OK;
+    size_t i;
 
-                sprintf(http->connection.req_headers + strlen(http->connection.req_headers),
-                        "%s\r\n", http->connection.include_headers);
-            }
-            else
-                sprintf(http->connection.req_headers + strlen(http->connection.req_headers),
-                        "%s\r\n", http->connection.include_headers);
-        }
+    for (i = 0; i < mime->count && ret == HTTP_OK; i++)
+    {
+        struct http_mime_part *p = &mime->parts[i];
+        ret = __send_chunk(http, flag, p->head, p->head_len, chunked);
+        if (ret != HTTP_OK)
+            break;
+        if (p->read_cb)
+            ret = __send_body_part(http, flag, p->read_cb, p->read_data, p->size, chunked);
+        else if (p->path || p->fd >= 0)
+            ret = __send_mime_file(http, flag, p, chunked);
+    }
+    if (ret != HTTP_OK)
+        return HTTP_ERROR;
 
-        if (strlen(http->connection.cookies) > 1)
+    int l = sprintf(end, "%s--%s--\r\n", mime->count ? "\r\n" : "", mime->boundary);
+    ret = __send_chunk(http, flag, end, l, chunked);
+    if (ret == HTTP_OK && chunked)
+        ret = __send_buffer(http, flag, "0\r\n\r\n", 5);
+    return ret;
+}
 
-            sprintf(http->connection.req_headers + strlen(http->connection.req_headers), "Cookies: %s\r\n",
-                    http->connection.cookies);
+/* On the fly Content-Encoding of a request body, used as a read callback */
+struct http_encoder
+{
+    enum http_body_encoding encoding;
+    http_read_callback read_cb; // the raw body
+    void *read_data;
+    char *in;                   // HTTP_STREAM_CHUNK bytes of raw body
+    size_t in_len;
+    size_t in_pos;
+    z_stream z;
+#ifdef LIBHTTP_WITH_ZSTD
+    ZSTD_CCtx *zstd;
+#endif
+    int eof;
+    int done;
+    int failed; // the compressor failed rather than the body source
+    long long raw;
+};
 
-        if (http->connection.connection)
-            sprintf(http->connection.req_headers + strlen(http->connection.req_headers),
-                    "Connection: %s\r\n", http->connection.connection);
+int __encoder_init(http_session http, struct http_encoder *e, enum http_body_encoding encoding,
+                   int level)
+{
+    int ok;
+    e->encoding = encoding;
+    e->in = (char *)malloc(HTTP_STREAM_CHUNK);
+    if (!e->in)
+    {
+        __set_error_msg(http, "%s", __get_error_msg());
+        http->error_code = errno;
+        return HTTP_ERROR;
+    }
 
-        else
-            sprintf(http->connection.req_headers + strlen(http->connection.req_headers),
-                    "Connection: close\r\n");
+#ifdef LIBHTTP_WITH_ZSTD
+    if (encoding == HTTP_BODY_ENCODING_ZSTD)
+    {
+        e->zstd = ZSTD_createCCtx();
+        ok = e->zstd && !ZSTD_isError(ZSTD_CCtx_setParameter(e->zstd, ZSTD_c_compressionLevel,
+                                                             level ? level : ZSTD_CLEVEL_DEFAULT));
+    }
+    else
+#endif
+        // windowBits + 16 writes a gzip header and trailer instead of zlib's
+        ok = deflateInit2(&e->z, level ? level : Z_DEFAULT_COMPRESSION, Z_DEFLATED,
+                          15 + 16, 8, Z_DEFAULT_STRATEGY) == Z_OK;
+    if (!ok)
+    {
+#ifdef LIBHTTP_WITH_ZSTD
+        ZSTD_freeCCtx(e->zstd);
+        e->zstd = NULL;
+#endif
+        free(e->in);
+        e->in = NULL;
+        __set_error_msg(http, "Can't initialize the compressor, invalid level %d", level);
+        http->error_code = HTTP_INVALID_OPTION;
+        return HTTP_ERROR;
+    }
+    return HTTP_OK;
+}
 
-        // Is a POST request
-        if (http->connection.method == HTTP_POST)
-        {
+void __encoder_end(struct http_encoder *e)
+{
+#ifdef LIBHTTP_WITH_ZSTD
+    if (e->encoding == HTTP_BODY_ENCODING_ZSTD)
+        ZSTD_freeCCtx(e->zstd);
+    else
+#endif
+        deflateEnd(&e->z);
+    free(e->in);
+}
 
-            // if content type is already provided
-            if (http->connection.content_type)
-                sprintf(http->connection.req_headers + strlen(http->connection.req_headers),
-                        "Content-Type: %s\r\n", http->connection.content_type);
-            else
-                sprintf(http->connection.req_headers + strlen(http->connection.req_headers),
-                        "Content-Type: application/x-www-form-urlencoded\r\n");
+// Compress the pending input into out, finishing the stream at EOF; -1 on errors
+size_t __encoder_step(struct http_encoder *e, char *out, size_t size)
+{
+#ifdef LIBHTTP_WITH_ZSTD
+    if (e->encoding == HTTP_BODY_ENCODING_ZSTD)
+    {
+        ZSTD_inBuffer zin = {e->in, e->in_len, e->in_pos};
+        ZSTD_outBuffer zout = {out, size, 0};
+        size_t left = ZSTD_compressStream2(e->zstd, &zout, &zin,
+                                           e->eof ? ZSTD_e_end : ZSTD_e_continue);
+        if (ZSTD_isError(left))
+            return (size_t)-1;
+        e->in_pos = zin.pos;
+        e->done = e->eof && left == 0;
+        return zout.pos;
+    }
+#endif
+    e->z.next_in = (Bytef *)e->in + e->in_pos;
+    e->z.avail_in = (uInt)(e->in_len - e->in_pos);
+    e->z.next_out = (Bytef *)out;
+    e->z.avail_out = (uInt)size;
+    int ret = deflate(&e->z, e->eof ? Z_FINISH : Z_NO_FLUSH);
+    if (ret == Z_STREAM_ERROR)
+        return (size_t)-1;
+    e->in_pos = e->in_len - e->z.avail_in;
+    e->done = ret == Z_STREAM_END;
+    return size - e->z.avail_out;
+}
 
-            sprintf(http->connection.req_headers + strlen(http->connection.req_headers),
-                    "Content-Length: %d\r\n", strlen(http->connection.post_body));
-        }
-        else if (http->connection.method == HTTP_PUT)
+// Read callback producing the encoded body, pulls the raw body as needed
+size_t __encoder_read(char *buf, size_t size, void *userdata)
+{
+    struct http_encoder *e = (struct http_encoder *)userdata;
+    size_t out = 0;
+    while (out < size && !e->done)
+    {
+        if (e->in_pos == e->in_len && !e->eof)
         {
-            // if content type is already provided
-            if (http->connection.content_type)
-                sprintf(http->connection.req_headers + strlen(http->connection.req_headers),
-                        "Content-Type: %s\r\n", http->connection.content_type);
-            else
-                sprintf(http->connection.req_headers + strlen(http->connection.req_headers),
-                        "Content-Type: text/html\r\n");
-
-            sprintf(http->connection.req_headers + strlen(http->connection.req_headers),
-                    "Content-Length: %d\r\n", strlen(http->connection.put_body));
+            size_t n = e->read_cb(e->in, HTTP_STREAM_CHUNK, e->read_data);
+            if (n == HTTP_READ_ABORT || n > HTTP_STREAM_CHUNK)
+                return HTTP_READ_ABORT;
+            e->in_len = n;
+            e->in_pos = 0;
+            e->eof = n == 0;
+            e->raw += n;
         }
-        else if (http->connection.method == HTTP_PATCH)
+        size_t n = __encoder_step(e, buf + out, size - out);
+        if (n == (size_t)-1)
         {
-            // if content type is already provided
-            if (http->connection.content_type)
-                sprintf(http->connection.req_headers + strlen(http->connection.req_headers),
-                        "Content-Type: %s\r\n", http->connection.content_type);
-            else
-                sprintf(http->connection.req_headers + strlen(http->connection.req_headers),
-                        "Content-Type: text/html\r\n");
-
-            sprintf(http->connection.req_headers + strlen(http->connection.req_headers),
-                    "Content-Length: %d\r\n", strlen(http->connection.patch_body));
+            e->failed = 1;
+            return HTTP_READ_ABORT;
         }
+        out += n;
     }
-    sprintf(http->connection.req_headers + strlen(http->connection.req_headers),
-            "\r\n");
+    return out;
 }
 
-// Send the requests to the server
-int __send_request_headers(http_session http, int flag)
+/* In-memory body as a read callback */
+struct http_mem_reader
 {
+    const char *data;
+    size_t left;
+};
 
-    // memset(http->connection.req_headers, 0, sizeof(MAXREQUEST));
-    // *http->connection.req_headers = NULL;
-    __construct_request_headers(http);
-    int bytes_sent = 0;
-    if (flag)
-    {
-        switch (http->proxy_flag)
-        {
-        case HTTP:
-            bytes_sent = send(http->proxy_socket, http->connection.req_headers,
-                              strlen(http->connection.req_headers), 0);
-            break;
-        case HTTPS:
-            bytes_sent = SSL_write(http->ssl.proxy_ssl, http->connection.req_headers,
-                                   strlen(http->connection.req_headers));
-            break;
+size_t __mem_read(char *buf, size_t size, void *userdata)
+{
+    struct http_mem_reader *m = (struct http_mem_reader *)userdata;
+    size_t n = size < m->left ? size : m->left;
+    memcpy(buf, m->data, n);
+    m->data += n;
+    m->left -= n;
+    return n;
+}
 
-        default:
-            bytes_sent = send(http->proxy_socket, http->connection.req_headers,
-                              strlen(http->connection.req_headers), 0);
-            break;
-        }
+/**
+ * Send the body compressed with the session's Content-Encoding. Whatever the
+ * source (read callback, file or memory), it is read and compressed
+ * HTTP_STREAM_CHUNK bytes at a time and sent chunked, so memory use doesn't
+ * depend on the body size.
+ */
+int __send_encoded(http_session http, int flag)
+{
+    struct http_conn_info *c = http->connection;
+    struct http_body *b = __method_body(http);
+    struct http_encoder e;
+    struct http_mem_reader mem;
+    int fd = -1;
+    int ret;
+
+    memset(&e, 0, sizeof(e));
+    if (c->read_cb)
+    {
+        e.read_cb = c->read_cb;
+        e.read_data = c->read_data;
     }
-    else
+    else if (b->file)
     {
-        switch (http->flag)
+        if ((fd = open(b->file, O_RDONLY)) < 0)
         {
-        case HTTP:
-            bytes_sent = send(http->socket, http->connection.req_headers,
-                              strlen(http->connection.req_headers), 0);
-            break;
-        case HTTPS:
-            bytes_sent = SSL_write(http->ssl.ssl, http->connection.req_headers,
-                                   strlen(http->connection.req_headers));
-            break;
-
-        default:
-            bytes_sent = send(http->socket, http->connection.req_headers,
-                              strlen(http->connection.req_headers), 0);
-            break;
+            __set_error_msg(http, "%s", __get_error_msg());
+            http->error_code = errno;
+            return HTTP_ERROR;
         }
+        e.read_cb = __fd_read;
+        e.read_data = &fd;
     }
-    if (bytes_sent < 1)
+    else
     {
-        __set_error_msg(http, "unfinished request, connection reset by peer\n");
-        http->error_code = HTTP_CONNECTION_RESET;
-        return HTTP_ERROR;
+        mem.data = b->data;
+        mem.left = b->len;
+        e.read_cb = __mem_read;
+        e.read_data = &mem;
     }
-    if (http->verbose == HTTP_VERBOSITY_ENABLE)
+
+    ret = __encoder_init(http, &e, __body_encoding(http), c->encoding_level);
+    if (ret == HTTP_OK)
     {
-        // printf("%s\n", http->connection.req_headers);
-        char *q = strdup(http->connection.req_headers);
-        fprintf(stdout, "<| ");
-        while (*q)
+        ret = __send_body_from(http, flag, __encoder_read, &e, -1);
+        if (e.failed)
         {
-            if (*q == '\n')
-            {
-                fprintf(stdout, "\n<| ");
-                *q++;
-            }
-            else
-            {
-                fprintf(stdout, "%c", *q);
-                *q++;
-            }
+            __set_error_msg(http, "Request body compression failed");
+            http->error_code = HTTP_INVALID_OPTION;
         }
-        fprintf(stdout, "\n");
-        if (http->lfp != NULL)
-            fprintf(http->lfp, "%s", http->connection.req_headers);
+        http->body_raw = e.raw;
+        __encoder_end(&e);
     }
-    return HTTP_OK;
+    if (fd >= 0)
+        close(fd);
+    return ret;
 }
 
 // To send body request of POST, PUT nad PATCH
 int __send_request_body(http_session http, int flag)
 {
+    struct http_conn_info *c = http->connection;
+    if (c->mime)
+        return __send_mime(http, flag, c->mime);
+    if (__body_encoding(http) != HTTP_BODY_ENCODING_IDENTITY)
+        return __send_encoded(http, flag);
+    if (c->read_cb)
+        return __send_body_from(http, flag, c->read_cb, c->read_data,
+                                c->body_size_known ? c->body_size : -1);
+
+    struct http_body *b = __method_body(http);
+    if (b && b->file)
+        return __send_body_file(http, flag, b);
+
+    size_t len;
+    const char *body = __request_body(http, &len);
+    if (!body)
+        return HTTP_ERROR;
+    if (len == 0)
+        return HTTP_OK;
 
-    int bytes_sent = 0;
-    char data[MAXREQUEST];
+    int ret = 1;
+#ifdef HTTP_HAVE_ZEROCOPY
+    if (http->zerocopy == HTTP_ZEROCOPY_ENABLE && len >= HTTP_ZEROCOPY_MIN &&
+        (flag ? http->proxy_flag : http->flag) != HTTPS)
+        ret = __send_zerocopy(http, flag, body, len);
+#endif
+    if (ret == 1)
+        ret = __send_buffer(http, flag, body, len);
+    if (ret != HTTP_OK)
+        return HTTP_ERROR;
 
-    switch (http->connection.method)
-    {
+    http->body_wire += len;
+    __log_sent(http, body, len);
+    return HTTP_OK;
+}
 
-    case HTTP_POST:
-        strcpy(data, http->connection.post_body);
-        if (flag)
-        {
-            switch (http->proxy_flag)
-            {
-            case HTTP:
-                bytes_sent = send(http->proxy_socket, http->connection.post_body,
-                                  strlen(http->connection.post_body), 0);
-                break;
-            case HTTPS:
-                bytes_sent = SSL_write(http->ssl.proxy_ssl, http->connection.post_body,
-                                       strlen(http->connection.post_body));
-                break;
+// Length of a complete interim (1xx) response at the start of data, 0 if there's none
+size_t __interim_len(const char *data, size_t len)
+{
+    const char *end;
+    if (len < 13 || memcmp(data, "HTTP/1.", 7) != 0 || data[9] != '1')
+        return 0;
+    for (end = data; end + 4 <= data + len; end++)
+        if (memcmp(end, "\r\n\r\n", 4) == 0)
+            return end + 4 - data;
+    return 0;
+}
 
-            default:
-                bytes_sent = send(http->proxy_socket, http->connection.post_body,
-                                  strlen(http->connection.post_body), 0);
-                break;
-            }
-        }
-        else
-        {
-            switch (http->flag)
-            {
+// Start timing the request for http_get_ttfb()
+void __request_started(http_session http)
+{
+    clock_gettime(CLOCK_MONOTONIC, &http->req_start);
+    http->ttfb = -1;
+}
 
-            case HTTP:
-                bytes_sent = send(http->socket, http->connection.post_body,
-                                  strlen(http->connection.post_body), 0);
-                break;
-            case HTTPS:
-                bytes_sent = SSL_write(http->ssl.ssl, http->connection.post_body,
-                                       strlen(http->connection.post_body));
-                break;
+// The first byte of the response arrived
+void __first_byte(http_session http)
+{
+    struct timespec now;
+    if (http->ttfb >= 0)
+        return;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    http->ttfb = (now.tv_sec - http->req_start.tv_sec) + (now.tv_nsec - http->req_start.tv_nsec) / 1e9;
+}
 
-            default:
-                bytes_sent = send(http->socket, http->connection.post_body,
-                                  strlen(http->connection.post_body), 0);
-                break;
-            }
-        }
-        break;
-    case HTTP_PUT:
-        strcpy(data, http->connection.put_body);
-        if (flag)
-        {
-            switch (http->flag)
-            {
-            case HTTP:
-                bytes_sent = send(http->proxy_socket, http->connection.put_body,
-                                  strlen(http->connection.put_body), 0);
-                break;
-            case HTTPS:
-                bytes_sent = SSL_write(http->ssl.proxy_ssl, http->connection.put_body,
-                                       strlen(http->connection.put_body));
-                break;
+/**
+ * After headers carrying Expect: 100-continue, wait for the server's answer.
+ * Interim responses are dropped; anything else, including the bytes after a
+ * 100 Continue, is kept in http->preread for the response parser.
+ * @returns HTTP_OK to send the body (100 Continue or timeout), 1 if a final
+ * response arrived and the body must not be sent, HTTP_ERROR
+ */
+int __wait_continue(http_session http, int flag)
+{
+    HTTPSOCKET sock = flag ? http->proxy_socket : http->socket;
+    SSL *ssl = (flag ? http->proxy_flag : http->flag) == HTTPS
+                   ? (flag ? http->ssl.proxy_ssl : http->ssl.ssl)
+                   : NULL;
+    int wait = http->connection->continue_timeout > 0 ? http->connection->continue_timeout
+                                                      : HTTP_CONTINUE_TIMEOUT;
+    struct timespec start, now;
+    size_t interim;
+
+    if (!http->preread && !(http->preread = (char *)malloc(HTTP_RECV_BUFFER)))
+    {
+        __set_error_msg(http, "%s", __get_error_msg());
+        http->error_code = errno;
+        return HTTP_ERROR;
+    }
+    http->preread_len = 0;
+    clock_gettime(CLOCK_MONOTONIC, &start);
 
-            default:
-                bytes_sent = send(http->proxy_socket, http->connection.put_body,
-                                  strlen(http->connection.put_body), 0);
-                break;
-            }
-        }
-        else
+    for (;;)
+    {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        long left = wait - ((now.tv_sec - start.tv_sec) * 1000 +
+                            (now.tv_nsec - start.tv_nsec) / 1000000);
+        if (left <= 0)
+            return HTTP_OK;
+
+        if (!ssl || !SSL_pending(ssl))
         {
-            switch (http->flag)
+            fd_set reads;
+            struct timeval timeout;
+            FD_ZERO(&reads);
+            FD_SET(sock, &reads);
+            timeout.tv_sec = left / 1000;
+            timeout.tv_usec = left % 1000 * 1000;
+            int r = select(sock + 1, &reads, 0, 0, &timeout);
+            if (r < 0 && errno == EINTR)
+                continue;
+            if (r < 0)
             {
-            case HTTP:
-                bytes_sent = send(http->socket, http->connection.put_body,
-                                  strlen(http->connection.put_body), 0);
-                break;
-            case HTTPS:
-                bytes_sent = SSL_write(http->ssl.ssl, http->connection.put_body,
-                                       strlen(http->connection.put_body));
-                break;
-
-            default:
-                bytes_sent = send(http->socket, http->connection.put_body,
-                                  strlen(http->connection.put_body), 0);
-                break;
+                __set_error_msg(http, "a call to select() failed");
+                return HTTP_ERROR;
             }
+            if (r == 0)
+                return HTTP_OK;
         }
-        break;
-    case HTTP_PATCH:
-        strcpy(data, http->connection.patch_body);
-        if (flag)
-        {
-            switch (http->flag)
-            {
-            case HTTP:
-                bytes_sent = send(http->proxy_socket, http->connection.patch_body,
-                                  strlen(http->connection.patch_body), 0);
-                break;
-            case HTTPS:
-                bytes_sent = SSL_write(http->ssl.proxy_ssl, http->connection.patch_body,
-                                       strlen(http->connection.patch_body));
-                break;
 
-            default:
-                bytes_sent = send(http->proxy_socket, http->connection.patch_body,
-                                  strlen(http->connection.patch_body), 0);
-                break;
-            }
+        char *p = http->preread + http->preread_len;
+        int n;
+        if (ssl)
+        {
+            // Session tickets make the socket readable too, don't block for data behind them
+            long mode = SSL_get_mode(ssl);
+            SSL_clear_mode(ssl, SSL_MODE_AUTO_RETRY);
+            n = SSL_read(ssl, p, HTTP_RECV_BUFFER - http->preread_len);
+            if (n < 1 && SSL_get_error(ssl, n) == SSL_ERROR_WANT_READ)
+                n = 0;
+            else if (n < 1)
+                n = -1;
+            SSL_set_mode(ssl, mode);
         }
         else
-        {
-            switch (http->flag)
-            {
-            case HTTP:
-                bytes_sent = send(http->socket, http->connection.patch_body,
-                                  strlen(http->connection.patch_body), 0);
-                break;
-            case HTTPS:
-                bytes_sent = SSL_write(http->ssl.ssl, http->connection.patch_body,
-                                       strlen(http->connection.patch_body));
-                break;
+            n = recv(sock, p, HTTP_RECV_BUFFER - http->preread_len, 0);
+        if (n == 0 && ssl)
+            continue;
+        // A closed connection is reported by the response parser
+        if (n < 1)
+            return 1;
+        http->preread_len += n;
+        __first_byte(http);
 
-            default:
-                bytes_sent = send(http->socket, http->connection.patch_body,
-                                  strlen(http->connection.patch_body), 0);
-                break;
-            }
+        while ((interim = __interim_len(http->preread, http->preread_len)))
+        {
+            int go = memcmp(http->preread + 9, "100", 3) == 0;
+            http->preread_len -= interim;
+            memmove(http->preread, http->preread + interim, http->preread_len);
+            if (go)
+                return HTTP_OK;
         }
-        break;
-    default:
+        // Anything but an interim response, or headers too large to be one
+        if (http->preread_len >= 13 && (memcmp(http->preread, "HTTP/1.", 7) != 0 ||
+                                        http->preread[9] != '1'))
+            return 1;
+        if (http->preread_len == HTTP_RECV_BUFFER)
+            return 1;
+    }
+}
+
+/**
+ * Send the request line, headers and body.
+ * Small requests leave in a single write, a writev() for plain HTTP or one
+ * SSL_write() (one TLS record) for HTTPS. Larger or streamed bodies are sent
+ * with the socket corked, so the headers share a segment with the first
+ * body bytes.
+ */
+int __send_request(http_session http, int flag)
+{
+    if (__construct_request_headers(http) != HTTP_OK)
         return HTTP_ERROR;
-    } // switch
 
-    if (http->verbose == HTTP_VERBOSITY_ENABLE)
+    struct http_body *b = __method_body(http);
+    size_t body_len = 0;
+    const char *body = __request_body(http, &body_len);
+    int streamed = __body_streamed(http);
+    enum connection_protocol proto = flag ? http->proxy_flag : http->flag;
+    HTTPSOCKET sock = flag ? http->proxy_socket : http->socket;
+    int ret;
+
+    http->body_raw = http->body_wire = 0;
+    http->body_skipped = 0;
+    http->preread_len = 0;
+    __request_started(http);
+
+    // Headers go out alone and the body waits for the server's go-ahead
+    if (b && __expect_continue(http))
     {
+        if (__send_buffer(http, flag, http->req_headers, http->req_len) != HTTP_OK)
+        {
+            __connection_abort(http, flag);
+            return HTTP_ERROR;
+        }
+        __log_sent(http, http->req_headers, http->req_len);
+        ret = __wait_continue(http, flag);
+        if (ret != HTTP_OK)
+        {
+            http->body_skipped = ret == 1;
+            if (ret != 1)
+                __connection_abort(http, flag);
+            return ret == 1 ? HTTP_OK : HTTP_ERROR;
+        }
+        __tcp_cork(sock, 1);
+        ret = __send_request_body(http, flag);
+        __tcp_cork(sock, 0);
+        if (__body_encoding(http) == HTTP_BODY_ENCODING_IDENTITY)
+            http->body_raw = http->body_wire;
+        // The server is reading a body that stopped halfway
+        if (ret != HTTP_OK)
+            __connection_abort(http, flag);
+        return ret;
+    }
 
-        char *q = strdup(data);
-        fprintf(stdout, "<| ");
-        while (*q)
+    if (!streamed && http->req_len + body_len <= HTTP_COALESCE_MAX)
+    {
+#if !defined(_WIN32)
+        if (proto != HTTPS)
+            ret = __send_iov(http, sock, http->req_headers, http->req_len, body, body_len);
+        else
+#endif
         {
-            if (*q == '\n')
-            {
-                fprintf(stdout, "\n<| ");
-                *q++;
-            }
-            else
-            {
-                fprintf(stdout, "%c", *q);
-                *q++;
-            }
+            // Append the body after the headers, req_len still covers the headers only
+            if (__reserve_request(http, http->req_len + body_len + 1) != HTTP_OK)
+                return HTTP_ERROR;
+            if (body_len)
+                memcpy(http->req_headers + http->req_len, body, body_len);
+            ret = __send_buffer(http, flag, http->req_headers, http->req_len + body_len);
         }
-        fprintf(stdout, "\n");
-        if (http->lfp != NULL)
-            fprintf(http->lfp, "%s", data);
+        if (ret != HTTP_OK)
+        {
+            __connection_abort(http, flag);
+            return HTTP_ERROR;
+        }
+        http->body_raw = http->body_wire = body_len;
+        __log_sent(http, http->req_headers, http->req_len);
+        if (body_len)
+            __log_sent(http, body, body_len);
+        return HTTP_OK;
     }
 
-    return HTTP_OK;
+    __tcp_cork(sock, 1);
+    ret = __send_buffer(http, flag, http->req_headers, http->req_len);
+    if (ret == HTTP_OK)
+    {
+        __log_sent(http, http->req_headers, http->req_len);
+        if (b)
+            ret = __send_request_body(http, flag);
+    }
+    __tcp_cork(sock, 0);
+    if (__body_encoding(http) == HTTP_BODY_ENCODING_IDENTITY)
+        http->body_raw = http->body_wire;
+    if (ret != HTTP_OK)
+        __connection_abort(http, flag);
+    return ret;
 }
 
-// Get status code
+// Status code of the last final response (interim 1xx ones are skipped), 0 before any
 int http_get_status_code(http_session http)
 {
+    return http->response.status;
+}
 
-    char *res = strdup(http->response.headers);
-    if (res == NULL)
-        return HTTP_OK;
-    char *hdr, *code;
-    if (strstr(res, "HTTP/1") || strstr(res, "HTTP/2"))
-    {
-
-        if (strstr(res, "HTTP/1.0"))
-            hdr = strdup(strstr(res, "HTTP/1.0"));
-        if (strstr(res, "HTTP/1.1"))
-            hdr = strdup(strstr(res, "HTTP/1.1"));
-        if (strstr(res, "HTTP/2.0"))
-            hdr = strdup(strstr(res, "HTTP/2.0"));
-        hdr += 9;
-        code = hdr;
-        while (*hdr && *hdr < 0 && *hdr > 9)
-            *hdr++;
-        if (*hdr < 0 && *hdr > 9)
-            *hdr = 0;
-        return atoi(code);
-    }
-    return HTTP_OK;
+// Protocol version of the last response's status line (enum http_version), 0 before any
+int http_get_response_version(http_session http)
+{
+    return http->response.status ? http->response.version : 0;
+}
+
+/**
+ * Reason phrase of the last response, *len bytes inside the headers
+ * (not NUL terminated), valid until the next response
+ */
+const char *http_get_reason_phrase(http_session http, size_t *len)
+{
+    *len = http->response.headers ? http->response.reason_len : 0;
+    return http->response.headers ? http->response.headers + http->response.reason_off : "";
 }
+
 // Get the http response headers
 const char *http_get_headers(http_session http)
 {
     return http->response.headers;
 }
-// Get the http response body
+/**
+ * Get the http response body, NUL terminated. A body received in several
+ * chunks is joined into one buffer on the first call.
+ * @returns NULL if that allocation fails
+ */
 const char *http_get_body(http_session http)
 {
-    return http->response.body;
+    struct http_response *r = &http->response;
+    if (!r->body)
+        return "";
+    if (r->body->next)
+    {
+        struct http_body_chunk *c = (struct http_body_chunk *)malloc(sizeof(*c) + r->body_len + 1);
+        if (!c)
+        {
+            __set_error_msg(http, "%s", __get_error_msg());
+            http->error_code = errno;
+            return NULL;
+        }
+        c->next = NULL;
+        c->cap = c->len = 0;
+        for (struct http_body_chunk *p = r->body; p; p = p->next)
+        {
+            memcpy(c->data + c->len, p->data, p->len);
+            c->len += p->len;
+        }
+        c->cap = c->len;
+        c->data[c->len] = 0;
+        __body_chunks_recycle(http, r->body);
+        r->body = r->tail = c;
+    }
+    return r->body->data;
+}
+
+// Length of the response body, which may contain NUL bytes
+size_t http_get_body_len(http_session http)
+{
+    return http->response.body_len;
+}
+
+/**
+ * The response body as received, without copying it: fills at most max
+ * segments pointing into the session's buffers, valid until the next request
+ * or http_get_body() (which joins them). Pass max 0 to count them first
+ * @returns the number of segments of the body, which may be more than max
+ */
+size_t http_get_body_segments(http_session http, struct http_body_segment *segments, size_t max)
+{
+    size_t n = 0;
+    for (struct http_body_chunk *c = http->response.body; c; c = c->next)
+    {
+        if (!c->len)
+            continue;
+        if (n < max)
+        {
+            segments[n].data = c->data;
+            segments[n].len = c->len;
+        }
+        n++;
+    }
+    return n;
+}
+
+/**
+ * Request body bytes of the last request, before Content-Encoding and as
+ * sent (without chunk framing). Both are equal for uncompressed bodies
+ */
+void http_get_upload_stats(http_session http, long long *raw_bytes, long long *wire_bytes)
+{
+    if (raw_bytes)
+        *raw_bytes = http->body_raw;
+    if (wire_bytes)
+        *wire_bytes = http->body_wire;
 }
 
-// Get a specific header field value
+/**
+ * Value of the first field called header_name (case insensitive) in the last
+ * response, without allocating. The value lives in the session until the next response
+ */
 const char *http_get_header(http_session http, const char *header_name)
 {
+    int f = __header_find(http, header_name);
+    return f < 0 ? NULL : http->response.index.values + http->response.index.fields[f].value_off;
+}
 
-    // Removing extra spaces(Just incase)
-    char *q = strdup(header_name);
-    char *k = q;
-    for (; *q != '\0'; *q++)
-        if (*q == ' ')
-            *q++ = '\b';
-
-    char *p;
-    char tmp[100], *ans;
-    sprintf(tmp, "\n%s: ", k);
-
-    if (!http->response.headers)
-    {
-        return NULL;
-    }
-    if (strstr(http->response.headers, tmp))
-    {
-
-        p = strdup(strstr(http->response.headers, tmp));
-        if (!p)
-            return NULL;
-
-        p = strchr(p, ' ');
-        p += 1;
-
-        ans = strtok(p, "\r\n");
-    }
-    else
+/**
+ * Iterate over the values of every field called header_name (Set-Cookie...),
+ * in the order they were received. Start with *pos set to 0
+ * @returns NULL after the last one
+ */
+const char *http_get_header_next(http_session http, const char *header_name, size_t *pos)
+{
+    struct http_header_index *x = &http->response.index;
+    int f = *pos ? (*pos <= x->count ? x->fields[*pos - 1].next : -1)
+                 : __header_find(http, header_name);
+    if (f < 0)
         return NULL;
-    return ans;
+    *pos = (size_t)f + 1;
+    return x->values + x->fields[f].value_off;
 }
 
 // Get an error describtion
@@ -1549,54 +3459,61 @@ const char *http_get_certificate_issuer(http_session http)
 int __http_connect(http_session http)
 {
 
-    char *buffer = (char *)malloc(sizeof(char) + MAXREQUEST);
-    switch (http->connection.version)
-    {
-    case HTTP_1_0:
-        sprintf(buffer, "CONNECT %s:%s HTTP/1.0\r\n", http->connection.hostname, http->connection.port);
-        break;
-    case HTTP_1_1:
-        sprintf(buffer, "CONNECT %s:%s HTTP/1.1\r\n", http->connection.hostname, http->connection.port);
-        break;
-    case HTTP_2:
-        sprintf(buffer, "CONNECT %s:%s HTTP/2.0\r\n", http->connection.hostname, http->connection.port);
-        break;
-    default:
-        sprintf(buffer, "CONNECT %s:%s HTTP/1.1\r\n", http->connection.hostname, http->connection.port);
-        break;
-    }
+    char buffer[MAXREQUEST];
+    struct http_writer w = {buffer, 0, sizeof(buffer), 0};
+
+    __writer_lit(&w, "CONNECT ");
+    __writer_str(&w, http->connection->hostname);
+    __writer_lit(&w, ":");
+    __writer_str(&w, http->connection->port);
+    __writer_lit(&w, " ");
+    __writer_token(&w, __version_token(http->connection->version));
+    __writer_lit(&w, "\r\n");
 
     // If headers are already provided by the user
-    if (http->connection.headers != NULL)
+    if (http->connection->headers != NULL)
     {
-        sprintf(buffer + strlen(buffer), "%s", http->connection.headers);
+        __writer_str(&w, http->connection->headers);
     }
     else
     {
+        __writer_lit(&w, "Host: ");
+        __writer_str(&w, http->connection->hostname);
+        __writer_lit(&w, ":");
+        __writer_str(&w, http->connection->port);
+        __writer_lit(&w, "\r\n");
 
-        sprintf(buffer + strlen(buffer), "Host: %s:%s\r\n", http->connection.hostname,
-                http->connection.port);
+        __writer_lit(&w, "User-Agent: " LIBHTTP_USER_AGENT "\r\n");
 
-        sprintf(buffer + strlen(buffer), "User-Agent: libhttp(nshell)/%s\r\n", libhttp_get_version());
+        if (http->connection->cookies[0] && http->connection->cookies[1])
+        {
+            __writer_lit(&w, "Cookies: ");
+            __writer_str(&w, http->connection->cookies);
+            __writer_lit(&w, "\r\n");
+        }
 
-        if (strlen(http->connection.cookies) > 1)
-            sprintf(buffer + strlen(buffer), "Cookies: %s\r\n", http->connection.cookies);
+        __writer_lit(&w, "Connection: keep-alive\r\n\r\n");
+    }
 
-        sprintf(buffer + strlen(buffer), "Connection: keep-alive\r\n\r\n");
+    if (__writer_finish(&w) != HTTP_OK)
+    {
+        __set_error_msg(http, "Request headers exceed %d bytes", MAXREQUEST - 1);
+        http->error_code = HTTP_REQUEST_TOO_LARGE;
+        return HTTP_ERROR;
     }
 
     int bytes_sent = 0;
     switch (http->proxy_flag)
     {
     case HTTP:
-        bytes_sent = send(http->proxy_socket, buffer, strlen(buffer), 0);
+        bytes_sent = send(http->proxy_socket, buffer, w.len, 0);
         break;
     case HTTPS:
-        bytes_sent = SSL_write(http->ssl.proxy_ssl, buffer, strlen(buffer));
+        bytes_sent = SSL_write(http->ssl.proxy_ssl, buffer, w.len);
         break;
 
     default:
-        bytes_sent = send(http->socket, buffer, strlen(buffer), 0);
+        bytes_sent = send(http->socket, buffer, w.len, 0);
         break;
     }
 
@@ -1620,21 +3537,265 @@ int __http_connect(http_session http)
                 *q++;
             }
             else
-            {
-                fprintf(stdout, "%c", *q);
-                *q++;
-            }
+            {
+                fprintf(stdout, "%c", *q);
+                *q++;
+            }
+        }
+        fprintf(stdout, "\n");
+        if (http->lfp != NULL)
+            fprintf(http->lfp, "%s", buffer);
+    }
+    return HTTP_OK;
+}
+
+// Establising connection
+int http_connect(http_session http)
+{
+
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints)); // Zero out structure
+
+    hints.ai_family = AF_UNSPEC;     // Address family
+    hints.ai_socktype = SOCK_STREAM; // TCP socket
+    hints.ai_flags = 0;
+    hints.ai_protocol = 0;
+
+    if (!http->connection->url && !http->connection->hostname &&
+        !http->connection->port)
+    {
+        __set_error_msg(http, "No connection URL\n");
+        http->error_code = HTTP_NO_URL;
+        return HTTP_ERROR;
+    }
+
+    // A paused response belongs to the connection being replaced
+    __paused_free(http);
+
+    struct addrinfo *peer_addr, *rp;
+    if (getaddrinfo(http->connection->hostname, http->connection->port,
+                    &hints, &peer_addr))
+    {
+        __set_error_msg(http, "%s", __get_error_msg());
+        http->error_code = errno;
+        return HTTP_ERROR;
+    }
+
+    HTTPSOCKET s;
+    int connected = 0;
+    char address[100];
+    // Connect to each address on the host until one connects successfully
+    for (rp = peer_addr; rp != NULL; rp = rp->ai_next)
+    {
+        if (http->verbose == 1)
+        {
+            memset(address, 0, sizeof(address));
+            getnameinfo(rp->ai_addr, rp->ai_addrlen, address, 100, 0, 0, NI_NUMERICHOST);
+            lfprintf(http, "** Trying %s:%s..\n", address, http->connection->port);
+        }
+        s = socket(rp->ai_family, rp->ai_socktype,
+                   rp->ai_protocol);
+        if (!IsValidSocket(s))
+            continue;
+
+        if (connect(s, rp->ai_addr, rp->ai_addrlen) != -1)
+        {
+            if (http->verbose == 1)
+                lfprintf(http, "** Connected to #%s (%s) #port (%s)\n", http->connection->hostname,
+                         address, http->connection->port);
+            connected = 1;
+            break;
+        }
+        CloseSocket(s);
+    }
+    if (!connected)
+    {
+        __set_error_msg(http, "%s", __get_error_msg());
+        http->error_code = errno;
+        return HTTP_ERROR;
+    }
+
+    http->connected = 1;
+    freeaddrinfo(peer_addr);
+    http->socket = s;
+    if (!IsValidSocket(s))
+    {
+        __set_error_msg(http, "%s", __get_error_msg());
+        http->error_code = errno;
+        return HTTP_ERROR;
+    }
+    __tcp_nodelay(s);
+    if (http->flag == HTTPS)
+    {
+        SSL *ssl_tmp;
+        SSL_CTX *ctx;
+        const SSL_METHOD *method;
+        switch (http->ssl.version)
+        {
+        case HTTP_TLS_1_0:
+            method = TLSv1_client_method();
+            break;
+        case HTTP_TLS_1_1:
+            method = TLSv1_1_client_method();
+            break;
+        case HTTP_TLS_1_2:
+            method = TLSv1_2_client_method();
+            break;
+        case HTTP_TLS_1_3:
+            method = TLS_client_method();
+            break;
+        default:
+            method = TLS_client_method();
+            break;
+        }
+        ctx = SSL_CTX_new(method);
+        // SSL_CTX_set_options(ctx, SSL_CTX_set_timeout(ctx, 0));
+        if (!ctx)
+        {
+            __set_error_msg(http, "SSL error\n");
+            http->error_code = HTTP_SSL_ERROR;
+            return HTTP_ERROR;
+        }
+        __ktls_enable(http, ctx);
+        /**
+         * If the user requested to use http/2, then we use
+         * SSL_CTX to set the type of protocol we want to negotiate with the server
+         */
+        if (http->connection->version == HTTP_2)
+        {
+            if (SSL_CTX_set_alpn_protos(ctx, (const unsigned char *)"\x02h2", 3) != 0)
+            {
+                __set_error_msg(http, "OpenSSL, ALPN: failed to set protocol 'h2'");
+                http->error_code = HTTP_SSL_ERROR;
+                return HTTP_ERROR;
+            }
+        }
+
+        ssl_tmp = SSL_new(ctx);
+        if (!ssl_tmp)
+        {
+            __set_error_msg(http, "SSL error");
+            http->error_code = HTTP_SSL_ERROR;
+            SSL_CTX_free(ctx);
+            return HTTP_ERROR;
+        }
+
+        if (!SSL_set_tlsext_host_name(ssl_tmp, http->connection->hostname))
+        {
+            SSL_CTX_free(ctx);
+            SSL_free(ssl_tmp);
+            return HTTP_ERROR;
+        }
+        // SSL_set_timeout(http->ssl.ssl, 5);
+        // printf("Timeout %d\n", SSL_get_timeout(http->ssl.ssl));
+        SSL_set_fd(ssl_tmp, http->socket);
+        if (SSL_connect(ssl_tmp) == -1)
+        {
+            SSL_CTX_free(ctx);
+            SSL_free(ssl_tmp);
+            __set_error_msg(http, "Failed to establish SSL/TLS connection");
+            http->error_code = HTTP_SSL_CONN_FAILED;
+            return HTTP_ERROR;
+        }
+        http->ssl.ssl = ssl_tmp;
+        if (http->verbose == 1 && http->ssl.ktls == HTTP_KTLS_ENABLE)
+        {
+            int k = __ktls_state(ssl_tmp);
+            lfprintf(http, "** kTLS: send %s, receive %s\n", k & HTTP_KTLS_TX ? "on" : "off",
+                     k & HTTP_KTLS_RX ? "on" : "off");
+        }
+
+        /**
+         * Connection established, check if the user requested to use http/2
+         * and that Openssl has negotaited with the server
+         */
+        if (http->connection->version == HTTP_2)
+        {
+            const unsigned char *alpn = NULL;
+            int alpnlen = 0;
+
+#ifndef OPENSSL_NO_NEXTPROTONEG
+            SSL_get0_next_proto_negotiated(http->ssl.ssl, &alpn, &alpnlen);
+#endif
+
+            if (alpn == NULL)
+            {
+                SSL_get0_alpn_selected(http->ssl.ssl, &alpn, &alpnlen);
+            }
+
+            if (alpn == NULL || alpnlen == 0 || memcmp("h2", alpn, 2) != 0)
+            {
+                if (http->verbose == 1)
+                {
+                    lfprintf(http, "** ALPN: server does'nt accept to use h2, switching to http/1.1\n");
+                }
+            }
+            else
+            {
+                http->ssl.alpn_h2_negotiated = 1;
+                if (http->verbose == 1)
+                {
+                    lfprintf(http, "** ALPN: server accepted to use h2\n");
+                }
+                int val = 1;
+                setsockopt(http->socket, IPPROTO_TCP, TCP_NODELAY, (char *)&val, sizeof(val));
+                /**
+                 * Hex value of:
+                 *  PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n
+                 *  0x505249202a20485454502f322e300d0a0d0a534d0d0a0d0a
+                 * An empty settings frame:
+                 *  0x000000040000000000
+                 */
+                const char *client_preface = "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n";
+                const char *settings_frame = "0x000000040000000000";
+                char read[1024];
+                SSL_write(http->ssl.ssl, client_preface, strlen(client_preface));
+                SSL_write(http->ssl.ssl, settings_frame, strlen(settings_frame));
+                int n = SSL_read(http->ssl.ssl, read, 1024);
+                if (n < 1)
+                {
+                    printf("Connection closed\n");
+                    exit(0);
+                }
+                printf("** Server preface: %.*s\n", n, read);
+            }
+        }
+        // Get the server certificate
+        X509 *cert = SSL_get_peer_certificate(http->ssl.ssl);
+        char *subject, *issuer;
+        if ((subject = strdup(X509_NAME_oneline(X509_get_subject_name(cert), 0, 0))) != NULL)
+        {
+            http->ssl.cert_subject = strdup(subject);
+            OPENSSL_free(subject);
+        }
+
+        if ((issuer = strdup(X509_NAME_oneline(X509_get_issuer_name(cert), 0, 0))) != NULL)
+        {
+            http->ssl.cert_issuer = strdup(issuer);
+            OPENSSL_free(issuer);
+        }
+        long verify = SSL_get_verify_result(http->ssl.ssl);
+        if (http->verbose == 1 && !http->ssl.is_printed)
+        {
+            lfprintf(http, "** certificate subject: %s\n", http_get_certificate_subject(http));
+            lfprintf(http, "** certificate issuer: %s\n", http_get_certificate_issuer(http));
+
+            if (verify == X509_V_OK)
+                lfprintf(http, "** certificate verification successful\n");
+            else
+                lfprintf(http, "** certificate verification failed\n");
+            http->ssl.is_printed = 1;
         }
-        fprintf(stdout, "\n");
-        if (http->lfp != NULL)
-            fprintf(http->lfp, "%s", buffer);
+        // unsigned char vectors[] = {
+        //     11, 'h', 't', 't', 'p', '/', '2'
+        // };
+        // unsigned int len = sizeof(vectors);
     }
-    free(buffer);
     return HTTP_OK;
 }
 
-// Establising connection
-int http_connect(http_session http)
+// Connect to a proxy server
+int http_proxy_connect(http_session http)
 {
 
     struct addrinfo hints;
@@ -1645,16 +3806,19 @@ int http_connect(http_session http)
     hints.ai_flags = 0;
     hints.ai_protocol = 0;
 
-    if (!http->connection.url && !http->connection.hostname &&
-        !http->connection.port)
+    if (!http->connection->proxy.url && !http->connection->proxy.hostname &&
+        !http->connection->proxy.port)
     {
         __set_error_msg(http, "No connection URL\n");
         http->error_code = HTTP_NO_URL;
         return HTTP_ERROR;
     }
 
+    // A paused response belongs to the connection being replaced
+    __paused_free(http);
+
     struct addrinfo *peer_addr, *rp;
-    if (getaddrinfo(http->connection.hostname, http->connection.port,
+    if (getaddrinfo(http->connection->proxy.hostname, http->connection->proxy.port,
                     &hints, &peer_addr))
     {
         __set_error_msg(http, "%s", __get_error_msg());
@@ -1672,7 +3836,7 @@ int http_connect(http_session http)
         {
             memset(address, 0, sizeof(address));
             getnameinfo(rp->ai_addr, rp->ai_addrlen, address, 100, 0, 0, NI_NUMERICHOST);
-            lfprintf(http, "** Trying %s:%s..\n", address, http->connection.port);
+            lfprintf(http, "** Trying %s:%s..\n", address, http->connection->proxy.port);
         }
         s = socket(rp->ai_family, rp->ai_socktype,
                    rp->ai_protocol);
@@ -1682,8 +3846,8 @@ int http_connect(http_session http)
         if (connect(s, rp->ai_addr, rp->ai_addrlen) != -1)
         {
             if (http->verbose == 1)
-                lfprintf(http, "** Connected to #%s (%s) #port (%s)\n", http->connection.hostname,
-                         address, http->connection.port);
+                lfprintf(http, "** Connected to #%s (%s) #port (%s)\n", http->connection->proxy.hostname,
+                         address, http->connection->proxy.port);
             connected = 1;
             break;
         }
@@ -1696,16 +3860,17 @@ int http_connect(http_session http)
         return HTTP_ERROR;
     }
 
-    http->connected = 1;
+    http->proxy_connected = 1;
     freeaddrinfo(peer_addr);
-    http->socket = s;
+    http->proxy_socket = s;
     if (!IsValidSocket(s))
     {
         __set_error_msg(http, "%s", __get_error_msg());
         http->error_code = errno;
         return HTTP_ERROR;
     }
-    if (http->flag == HTTPS)
+    __tcp_nodelay(s);
+    if (http->proxy_flag == HTTPS)
     {
         SSL *ssl_tmp;
         SSL_CTX *ctx;
@@ -1736,11 +3901,12 @@ int http_connect(http_session http)
             http->error_code = HTTP_SSL_ERROR;
             return HTTP_ERROR;
         }
+        __ktls_enable(http, ctx);
         /**
          * If the user requested to use http/2, then we use
          * SSL_CTX to set the type of protocol we want to negotiate with the server
          */
-        if (http->connection.version == HTTP_2)
+        if (http->connection->version == HTTP_2)
         {
             if (SSL_CTX_set_alpn_protos(ctx, (const unsigned char *)"\x02h2", 3) != 0)
             {
@@ -1759,7 +3925,7 @@ int http_connect(http_session http)
             return HTTP_ERROR;
         }
 
-        if (!SSL_set_tlsext_host_name(ssl_tmp, http->connection.hostname))
+        if (!SSL_set_tlsext_host_name(ssl_tmp, http->connection->proxy.hostname))
         {
             SSL_CTX_free(ctx);
             SSL_free(ssl_tmp);
@@ -1767,7 +3933,7 @@ int http_connect(http_session http)
         }
         // SSL_set_timeout(http->ssl.ssl, 5);
         // printf("Timeout %d\n", SSL_get_timeout(http->ssl.ssl));
-        SSL_set_fd(ssl_tmp, http->socket);
+        SSL_set_fd(ssl_tmp, http->proxy_socket);
         if (SSL_connect(ssl_tmp) == -1)
         {
             SSL_CTX_free(ctx);
@@ -1776,24 +3942,24 @@ int http_connect(http_session http)
             http->error_code = HTTP_SSL_CONN_FAILED;
             return HTTP_ERROR;
         }
-        http->ssl.ssl = ssl_tmp;
+        http->ssl.proxy_ssl = ssl_tmp;
 
         /**
          * Connection established, check if the user requested to use http/2
          * and that Openssl has negotaited with the server
          */
-        if (http->connection.version == HTTP_2)
+        if (http->connection->version == HTTP_2)
         {
             const unsigned char *alpn = NULL;
             int alpnlen = 0;
 
 #ifndef OPENSSL_NO_NEXTPROTONEG
-            SSL_get0_next_proto_negotiated(http->ssl.ssl, &alpn, &alpnlen);
+            SSL_get0_next_proto_negotiated(http->ssl.proxy_ssl, &alpn, &alpnlen);
 #endif
 
             if (alpn == NULL)
             {
-                SSL_get0_alpn_selected(http->ssl.ssl, &alpn, &alpnlen);
+                SSL_get0_alpn_selected(http->ssl.proxy_ssl, &alpn, &alpnlen);
             }
 
             if (alpn == NULL || alpnlen == 0 || memcmp("h2", alpn, 2) != 0)
@@ -1810,21 +3976,11 @@ int http_connect(http_session http)
                 {
                     lfprintf(http, "** ALPN: server accepted to use h2\n");
                 }
-                int val = 1;
-                setsockopt(http->socket, IPPROTO_TCP, TCP_NODELAY, (char *)&val, sizeof(val));
-                /**
-                 * Hex value of:
-                 *  PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n
-                 *  0x505249202a20485454502f322e300d0a0d0a534d0d0a0d0a
-                 * An empty settings frame:
-                 *  0x000000040000000000
-                 */
                 const char *client_preface = "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n";
-                const char *settings_frame = "0x000000040000000000";
                 char read[1024];
-                SSL_write(http->ssl.ssl, client_preface, strlen(client_preface));
-                SSL_write(http->ssl.ssl, settings_frame, strlen(settings_frame));
-                int n = SSL_read(http->ssl.ssl, read, 1024);
+                SSL_write(http->ssl.proxy_ssl, client_preface, strlen(client_preface));
+                // SSL_write(http->ssl.ssl, "HTTP2-Settings: ENABLE_PUSH", 21);
+                int n = SSL_read(http->ssl.proxy_ssl, read, 1024);
                 if (n < 1)
                 {
                     printf("Connection closed\n");
@@ -1834,7 +3990,7 @@ int http_connect(http_session http)
             }
         }
         // Get the server certificate
-        X509 *cert = SSL_get_peer_certificate(http->ssl.ssl);
+        X509 *cert = SSL_get_peer_certificate(http->ssl.proxy_ssl);
         char *subject, *issuer;
         if ((subject = strdup(X509_NAME_oneline(X509_get_subject_name(cert), 0, 0))) != NULL)
         {
@@ -1847,8 +4003,8 @@ int http_connect(http_session http)
             http->ssl.cert_issuer = strdup(issuer);
             OPENSSL_free(issuer);
         }
-        long verify = SSL_get_verify_result(http->ssl.ssl);
-        if (http->verbose == 1 && !http->ssl.is_printed)
+        long verify = SSL_get_verify_result(http->ssl.proxy_ssl);
+        if (http->verbose == 1)
         {
             lfprintf(http, "** certificate subject: %s\n", http_get_certificate_subject(http));
             lfprintf(http, "** certificate issuer: %s\n", http_get_certificate_issuer(http));
@@ -1857,7 +4013,6 @@ int http_connect(http_session http)
                 lfprintf(http, "** certificate verification successful\n");
             else
                 lfprintf(http, "** certificate verification failed\n");
-            http->ssl.is_printed = 1;
         }
         // unsigned char vectors[] = {
         //     11, 'h', 't', 't', 'p', '/', '2'
@@ -1867,450 +4022,1194 @@ int http_connect(http_session http)
     return HTTP_OK;
 }
 
-// Connect to a proxy server
-int http_proxy_connect(http_session http)
+// Following redirects
+int __follow_redirect__(http_session http, char *location)
 {
 
-    struct addrinfo hints;
-    memset(&hints, 0, sizeof(hints)); // Zero out structure
+    if (__conn_mut(http) != HTTP_OK)
+        return HTTP_ERROR;
+    http->connection->url = location;
+    http->connection->hostname = "";
+    http->connection->port = "";
+    http->connection->path = "";
+    http->connection->query = "";
+
+    __parse_url(http, &http->connection->hostname, &http->connection->port,
+                &http->connection->path, &http->connection->query);
+    if (http_connect(http) != HTTP_OK)
+    {
+        return HTTP_ERROR;
+    }
+    int ret = http_session_start(http);
+    if (ret == HTTP_ERROR)
+        return HTTP_ERROR;
+    http->connection->c_redirect_num += 1;
+    return ret;
+}
 
-    hints.ai_family = AF_UNSPEC;     // Address family
-    hints.ai_socktype = SOCK_STREAM; // TCP socket
-    hints.ai_flags = 0;
-    hints.ai_protocol = 0;
+// following redirects for proxy connection
 
-    if (!http->connection.proxy.url && !http->connection.proxy.hostname &&
-        !http->connection.proxy.port)
-    {
-        __set_error_msg(http, "No connection URL\n");
-        http->error_code = HTTP_NO_URL;
+int __follow_redirect_proxy__(http_session http, char *location)
+{
+
+    if (__conn_mut(http) != HTTP_OK)
         return HTTP_ERROR;
+    http->connection->url = location;
+    http->connection->hostname = "";
+    http->connection->port = "";
+    http->connection->path = "";
+    http->connection->query = "";
+
+    __parse_url(http, &http->connection->hostname, &http->connection->port,
+                &http->connection->path, &http->connection->query);
+
+    int ret = http_proxy_session_start(http);
+    if (ret == HTTP_ERROR)
+        return HTTP_ERROR;
+    http->connection->c_redirect_num += 1;
+    return ret;
+}
+
+// Keep emptied body chunks for the next responses, up to HTTP_BODY_POOL_MAX bytes
+void __body_chunks_recycle(http_session http, struct http_body_chunk *c)
+{
+    while (c)
+    {
+        struct http_body_chunk *next = c->next;
+        if (http->response.spare_size + c->cap <= HTTP_BODY_POOL_MAX)
+        {
+            c->next = http->response.spare;
+            http->response.spare = c;
+            http->response.spare_size += c->cap;
+        }
+        else
+            free(c);
+        c = next;
     }
+}
 
-    struct addrinfo *peer_addr, *rp;
-    if (getaddrinfo(http->connection.proxy.hostname, http->connection.proxy.port,
-                    &hints, &peer_addr))
+void __body_chunks_free(struct http_body_chunk *c)
+{
+    while (c)
     {
-        __set_error_msg(http, "%s", __get_error_msg());
-        http->error_code = errno;
+        struct http_body_chunk *next = c->next;
+        free(c);
+        c = next;
+    }
+}
+
+// Empty the response body before the next response
+void __response_body_reset(http_session http)
+{
+    __body_chunks_recycle(http, http->response.body);
+    http->response.body = http->response.tail = NULL;
+    http->response.body_len = 0;
+    http->response.content_length = -1;
+}
+
+// A chunk of about size bytes, a pooled one when there is any
+struct http_body_chunk *__body_chunk_new(http_session http, size_t size)
+{
+    struct http_body_chunk *c = http->response.spare;
+    if (c)
+    {
+        http->response.spare = c->next;
+        http->response.spare_size -= c->cap;
+    }
+    else
+    {
+        if (size < HTTP_BODY_CHUNK_MIN)
+            size = HTTP_BODY_CHUNK_MIN;
+        if (size > HTTP_BODY_CHUNK_MAX)
+            size = HTTP_BODY_CHUNK_MAX;
+        if (!(c = (struct http_body_chunk *)malloc(sizeof(*c) + size + 1)))
+        {
+            __set_error_msg(http, "%s", __get_error_msg());
+            http->error_code = errno;
+            return NULL;
+        }
+        c->cap = size;
+    }
+    c->next = NULL;
+    c->len = 0;
+    c->data[0] = 0;
+    return c;
+}
+
+// Append received body bytes, whatever they contain
+int __response_body_append(http_session http, const char *data, size_t len)
+{
+    struct http_response *r = &http->response;
+    long long max = http->connection->max_response;
+    if (max > 0 && (long long)(r->body_len + len) > max)
+    {
+        __set_error_msg(http, "Response body is larger than %lld bytes", max);
+        http->error_code = HTTP_RESPONSE_TOO_LARGE;
         return HTTP_ERROR;
     }
+    while (len)
+    {
+        struct http_body_chunk *t = r->tail;
+        if (!t || t->len == t->cap)
+        {
+            // Each chunk doubles the previous one, so large bodies take few allocations
+            if (!(t = __body_chunk_new(http, r->tail ? r->tail->cap * 2 : 0)))
+                return HTTP_ERROR;
+            if (r->tail)
+                r->tail->next = t;
+            else
+                r->body = t;
+            r->tail = t;
+        }
+        size_t n = t->cap - t->len < len ? t->cap - t->len : len;
+        memcpy(t->data + t->len, data, n);
+        t->len += n;
+        t->data[t->len] = 0;
+        r->body_len += n;
+        data += n;
+        len -= n;
+    }
+    return HTTP_OK;
+}
 
-    HTTPSOCKET s;
-    int connected = 0;
-    char address[100];
-    // Connect to each address on the host until one connects successfully
-    for (rp = peer_addr; rp != NULL; rp = rp->ai_next)
+/*
+ * Byte scanners used by the response parser. Character classes are
+ * 16-byte tables indexed by the low nibble, bit n set when the byte with
+ * high nibble n belongs to the class, so a vector lookup (pshufb, or
+ * vqtbl1q on NEON) classifies 16 or 32 bytes at once. Bytes >= 0x80 are
+ * never in a class.
+ */
+static const unsigned char __token_class[16] = {
+    0xe8, 0xfc, 0xf8, 0xfc, 0xfc, 0xfc, 0xfc, 0xfc,
+    0xf8, 0xf8, 0xf4, 0x54, 0xd0, 0x54, 0xf4, 0x70}; // tchar of RFC 9110
+static const unsigned char __hex_class[16] = {
+    0x08, 0x58, 0x58, 0x58, 0x58, 0x58, 0x58, 0x08,
+    0x08, 0x08, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00};
+
+enum http_simd
+{
+    HTTP_SIMD_NONE,
+    HTTP_SIMD_SSE42,
+    HTTP_SIMD_AVX2
+};
+
+// Instruction set the scanners use, -1 until the CPU has been probed
+int __simd_cpu = -1;
+
+int __simd_level(void)
+{
+#ifdef HTTP_HAVE_SIMD_X86
+    int level = __atomic_load_n(&__simd_cpu, __ATOMIC_RELAXED);
+    if (level < 0)
     {
-        if (http->verbose == 1)
+        __builtin_cpu_init();
+        level = __builtin_cpu_supports("avx2") ? HTTP_SIMD_AVX2 : __builtin_cpu_supports("sse4.2") ? HTTP_SIMD_SSE42 : HTTP_SIMD_NONE;
+        __atomic_store_n(&__simd_cpu, level, __ATOMIC_RELAXED);
+    }
+    return level;
+#else
+    return HTTP_SIMD_NONE;
+#endif
+}
+
+int __in_class(unsigned char c, const unsigned char *cls)
+{
+    return c < 0x80 && (cls[c & 0x0f] >> (c >> 4)) & 1;
+}
+
+#ifdef HTTP_HAVE_SIMD_X86
+__attribute__((target("avx2"))) size_t __scan_lf_avx2(const char *s, size_t len)
+{
+    const __m256i lf = _mm256_set1_epi8('\n');
+    size_t i = 0;
+    for (; i + 32 <= len; i += 32)
+    {
+        unsigned mask = (unsigned)_mm256_movemask_epi8(
+            _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(s + i)), lf));
+        if (mask)
+            return i + __builtin_ctz(mask);
+    }
+    for (; i < len && s[i] != '\n'; i++)
+        ;
+    return i;
+}
+
+__attribute__((target("avx2"))) size_t __span_class_avx2(const char *s, size_t len, const unsigned char *cls)
+{
+    const __m256i lo_class = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)cls));
+    const __m256i hi_bit = _mm256_setr_epi8(1, 2, 4, 8, 16, 32, 64, -128, 0, 0, 0, 0, 0, 0, 0, 0,
+                                            1, 2, 4, 8, 16, 32, 64, -128, 0, 0, 0, 0, 0, 0, 0, 0);
+    const __m256i nibble = _mm256_set1_epi8(0x0f);
+    size_t i = 0;
+    for (; i + 32 <= len; i += 32)
+    {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(s + i));
+        __m256i lo = _mm256_shuffle_epi8(lo_class, _mm256_and_si256(v, nibble));
+        __m256i hi = _mm256_shuffle_epi8(hi_bit, _mm256_and_si256(_mm256_srli_epi16(v, 4), nibble));
+        unsigned mask = (unsigned)_mm256_movemask_epi8(
+            _mm256_cmpeq_epi8(_mm256_and_si256(lo, hi), _mm256_setzero_si256()));
+        if (mask)
+            return i + __builtin_ctz(mask);
+    }
+    for (; i < len && __in_class((unsigned char)s[i], cls); i++)
+        ;
+    return i;
+}
+
+__attribute__((target("sse4.2"))) size_t __scan_lf_sse42(const char *s, size_t len)
+{
+    const __m128i lf = _mm_set1_epi8('\n');
+    size_t i = 0;
+    for (; i + 16 <= len; i += 16)
+    {
+        unsigned mask = (unsigned)_mm_movemask_epi8(
+            _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(s + i)), lf));
+        if (mask)
+            return i + __builtin_ctz(mask);
+    }
+    for (; i < len && s[i] != '\n'; i++)
+        ;
+    return i;
+}
+
+__attribute__((target("sse4.2"))) size_t __span_class_sse42(const char *s, size_t len, const unsigned char *cls)
+{
+    const __m128i lo_class = _mm_loadu_si128((const __m128i *)cls);
+    const __m128i hi_bit = _mm_setr_epi8(1, 2, 4, 8, 16, 32, 64, -128, 0, 0, 0, 0, 0, 0, 0, 0);
+    const __m128i nibble = _mm_set1_epi8(0x0f);
+    size_t i = 0;
+    for (; i + 16 <= len; i += 16)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i *)(s + i));
+        __m128i lo = _mm_shuffle_epi8(lo_class, _mm_and_si128(v, nibble));
+        __m128i hi = _mm_shuffle_epi8(hi_bit, _mm_and_si128(_mm_srli_epi16(v, 4), nibble));
+        unsigned mask = (unsigned)_mm_movemask_epi8(
+            _mm_cmpeq_epi8(_mm_and_si128(lo, hi), _mm_setzero_si128()));
+        if (mask)
+            return i + __builtin_ctz(mask);
+    }
+    for (; i < len && __in_class((unsigned char)s[i], cls); i++)
+        ;
+    return i;
+}
+#endif
+
+// Offset of the first LF in s, len if there is none
+size_t __scan_lf(const char *s, size_t len)
+{
+#ifdef HTTP_HAVE_SIMD_X86
+    switch (__simd_level())
+    {
+    case HTTP_SIMD_AVX2:
+        return __scan_lf_avx2(s, len);
+    case HTTP_SIMD_SSE42:
+        return __scan_lf_sse42(s, len);
+    }
+#endif
+    const char *nl = (const char *)memchr(s, '\n', len);
+    return nl ? (size_t)(nl - s) : len;
+}
+
+// Length of the prefix of s made only of bytes of the class cls
+size_t __span_class(const char *s, size_t len, const unsigned char *cls)
+{
+#ifdef HTTP_HAVE_SIMD_X86
+    switch (__simd_level())
+    {
+    case HTTP_SIMD_AVX2:
+        return __span_class_avx2(s, len, cls);
+    case HTTP_SIMD_SSE42:
+        return __span_class_sse42(s, len, cls);
+    }
+#endif
+    size_t i = 0;
+    while (i < len && __in_class((unsigned char)s[i], cls))
+        i++;
+    return i;
+}
+
+// Value of n hex digits, which must all be valid
+long long __hex_value(const char *s, size_t n)
+{
+    long long v = 0;
+    for (size_t i = 0; i < n; i++)
+    {
+        unsigned char c = (unsigned char)s[i];
+        v = v * 16 + (c & 0x0f) + 9 * (c >> 6); // '0'-'9', 'A'-'F' and 'a'-'f'
+    }
+    return v;
+}
+
+/**
+ * Hand decoded body bytes to the write callback, or keep them in the session
+ * @returns HTTP_PAUSED when the callback pauses the transfer
+ */
+int __response_body_write(http_session http, const char *data, size_t len)
+{
+    struct http_conn_info *c = http->connection;
+    if (!c->write_cb)
+        return __response_body_append(http, data, len);
+    if (!len)
+        return HTTP_OK;
+
+    size_t r = c->write_cb(data, len, c->write_data);
+    if (r == len)
+        return HTTP_OK;
+    if (r == HTTP_WRITE_PAUSE)
+        return HTTP_PAUSED;
+    __set_error_msg(http, "Response body aborted by the write callback");
+    http->error_code = HTTP_ABORTED_BY_CALLBACK;
+    return HTTP_ERROR;
+}
+
+/* Incremental HTTP/1.x response parser, fed whatever the connection returns */
+enum http_parse_state
+{
+    HTTP_PARSE_HEAD,       // status line and header fields
+    HTTP_PARSE_LENGTH,     // body delimited by Content-Length
+    HTTP_PARSE_CLOSE,      // body delimited by the end of the connection
+    HTTP_PARSE_CHUNK_SIZE,    // hex size line of the next chunk
+    HTTP_PARSE_CHUNK_SIZE_LF, // LF after a CR ending the size line
+    HTTP_PARSE_CHUNK_EXT,     // chunk extensions, skipped up to the end of the line
+    HTTP_PARSE_CHUNK_DATA,
+    HTTP_PARSE_CHUNK_END,     // CRLF after the chunk data
+    HTTP_PARSE_CHUNK_END_LF,  // LF after its CR
+    HTTP_PARSE_TRAILER,    // trailer fields up to an empty line
+    HTTP_PARSE_DONE
+};
+
+struct http_parser
+{
+    enum http_parse_state state;
+    char *head; // status line and header fields of the response being read
+    size_t head_len;
+    size_t head_cap;
+    size_t line; // start of the current line in head
+    int status;
+    int no_body;         // the request was HEAD
+    int head_done;       // the header fields were just completed
+    long long remaining; // body bytes left, or bytes left in the current chunk
+    int digits;          // hex digits of the chunk size read so far
+    size_t trailer_len;  // length of the current trailer line
+    int paused;          // the write callback paused on the body bytes at the returned offset
+    int discard;         // the header callback aborted, body bytes are drained
+    long long drained;
+};
+
+void __parser_init(struct http_parser *p, int no_body)
+{
+    memset(p, 0, sizeof(*p));
+    p->state = HTTP_PARSE_HEAD;
+    p->no_body = no_body;
+}
+
+void __parser_free(struct http_parser *p)
+{
+    free(p->head);
+    p->head = NULL;
+}
+
+// Whether the last transfer coding of a Transfer-Encoding value is chunked
+int __is_chunked(const char *value, size_t len)
+{
+    while (len && (value[len - 1] == ' ' || value[len - 1] == '\t'))
+        len--;
+    return len >= 7 && strncasecmp(value + len - 7, "chunked", 7) == 0 &&
+           (len == 7 || value[len - 8] == ',' || value[len - 8] == ' ');
+}
+
+void __header_index_free(struct http_header_index *x)
+{
+    free(x->values);
+    free(x->fields);
+    free(x->slots);
+    memset(x, 0, sizeof(*x));
+}
+
+// Case insensitive hash of a field name, eight bytes at a time
+unsigned __field_hash(const char *name, size_t len)
+{
+    unsigned long long h = len * 0x9e3779b97f4a7c15ull, w;
+    for (; len >= 8; name += 8, len -= 8)
+    {
+        memcpy(&w, name, 8);
+        h = (h ^ (w | 0x2020202020202020ull)) * 0xff51afd7ed558ccdull;
+        h ^= h >> 32;
+    }
+    if (len)
+    {
+        w = 0;
+        for (size_t i = 0; i < len; i++)
+            w |= (unsigned long long)(unsigned char)name[i] << (i * 8);
+        h = (h ^ (w | 0x2020202020202020ull)) * 0xff51afd7ed558ccdull;
+        h ^= h >> 32;
+    }
+    return (unsigned)h;
+}
+
+// Start collecting the fields of a new header block, the buffers are reused between responses
+void __header_index_begin(http_session http)
+{
+    struct http_header_index *x = &http->response.index;
+    x->count = 0;
+    x->len = 0;
+    x->built = 0;
+}
+
+int __header_index_add(http_session http, size_t name_off, size_t name_len,
+                       size_t value_off, size_t value_len)
+{
+    struct http_header_index *x = &http->response.index;
+    if (x->count == x->cap)
+    {
+        size_t cap = x->cap ? x->cap * 2 : 32;
+        struct http_field *fields = (struct http_field *)realloc(x->fields, cap * sizeof(*fields));
+        if (!fields)
         {
-            memset(address, 0, sizeof(address));
-            getnameinfo(rp->ai_addr, rp->ai_addrlen, address, 100, 0, 0, NI_NUMERICHOST);
-            lfprintf(http, "** Trying %s:%s..\n", address, http->connection.proxy.port);
+            __set_error_msg(http, "%s", __get_error_msg());
+            http->error_code = errno;
+            return HTTP_ERROR;
         }
-        s = socket(rp->ai_family, rp->ai_socktype,
-                   rp->ai_protocol);
-        if (!IsValidSocket(s))
-            continue;
+        x->fields = fields;
+        x->cap = cap;
+    }
+    struct http_field *f = &x->fields[x->count++];
+    f->name_off = (unsigned)name_off;
+    f->name_len = (unsigned)name_len;
+    f->value_off = (unsigned)value_off;
+    f->value_len = (unsigned)value_len;
+    f->folded = 0;
+    f->next = -1;
+    return HTTP_OK;
+}
+
+// Slot of name in the table: the one holding its first field, or the free slot it would take
+size_t __header_slot(struct http_header_index *x, const char *name, size_t len, unsigned hash)
+{
+    size_t mask = x->nslots - 1;
+    for (size_t i = hash & mask;; i = (i + 1) & mask)
+    {
+        int f = x->slots[i];
+        if (f < 0 || (x->fields[f].hash == hash && x->fields[f].name_len == len &&
+                      strncasecmp(x->values + x->fields[f].name_off, name, len) == 0))
+            return i;
+    }
+}
+
+/**
+ * Build the table on the first lookup, so responses nobody asks about cost
+ * only the field offsets. The values are copied out of the header block and
+ * NUL terminated, repeated names are chained in order
+ */
+int __header_index_build(http_session http)
+{
+    struct http_header_index *x = &http->response.index;
+    size_t nslots = 16;
+    while (nslots < x->count * 2)
+        nslots *= 2;
+    if (nslots > x->nslots)
+    {
+        int *slots = (int *)realloc(x->slots, nslots * sizeof(*slots));
+        if (!slots)
+            return HTTP_ERROR;
+        x->slots = slots;
+        x->nslots = nslots;
+    }
+    if (x->len + 1 > x->values_cap)
+    {
+        char *values = (char *)realloc(x->values, x->len + 1);
+        if (!values)
+            return HTTP_ERROR;
+        x->values = values;
+        x->values_cap = x->len + 1;
+    }
+    memcpy(x->values, http->response.headers, x->len + 1);
+    memset(x->slots, 0xff, x->nslots * sizeof(*x->slots));
 
-        if (connect(s, rp->ai_addr, rp->ai_addrlen) != -1)
+    for (size_t i = 0; i < x->count; i++)
+    {
+        struct http_field *f = &x->fields[i];
+        char *value = x->values + f->value_off;
+        value[f->value_len] = 0;
+        f->next = -1;
+        // Continuation lines are joined with spaces
+        for (unsigned j = 0; f->folded && j < f->value_len; j++)
+            if (value[j] == '\r' || value[j] == '\n' ||
+                (value[j] == '\t' && j && value[j - 1] == ' '))
+                value[j] = ' ';
+        f->hash = __field_hash(x->values + f->name_off, f->name_len);
+        size_t slot = __header_slot(x, x->values + f->name_off, f->name_len, f->hash);
+        if (x->slots[slot] < 0)
         {
-            if (http->verbose == 1)
-                lfprintf(http, "** Connected to #%s (%s) #port (%s)\n", http->connection.proxy.hostname,
-                         address, http->connection.proxy.port);
-            connected = 1;
-            break;
+            x->slots[slot] = (int)i;
+            continue;
         }
-        CloseSocket(s);
+        struct http_field *last = &x->fields[x->slots[slot]];
+        while (last->next >= 0)
+            last = &x->fields[last->next];
+        last->next = (int)i;
     }
-    if (!connected)
+    x->built = 1;
+    return HTTP_OK;
+}
+
+// First field called name, -1 if the response has none
+int __header_find(http_session http, const char *name)
+{
+    struct http_header_index *x = &http->response.index;
+    if (!x->count || !x->len || !name || (!x->built && __header_index_build(http) != HTTP_OK))
+        return -1;
+    size_t len = strlen(name);
+    return x->slots[__header_slot(x, name, len, __field_hash(name, len))];
+}
+
+/**
+ * Parse a status line of len bytes, "HTTP/x.y SSS reason" without the CRLF.
+ * The reason phrase starts at *reason and runs to the end of the line
+ * @returns the status code, -1 if the line isn't a status line
+ */
+int __parse_status_line(const char *line, size_t len, enum http_version *version, size_t *reason)
+{
+    if (len < 12 || strncmp(line, "HTTP/", 5) != 0 || line[6] != '.' ||
+        line[7] < '0' || line[7] > '9' || line[8] != ' ' ||
+        line[9] < '1' || line[9] > '5' || line[10] < '0' || line[10] > '9' ||
+        line[11] < '0' || line[11] > '9' || (len > 12 && line[12] != ' '))
+        return -1;
+    if (line[5] == '1')
+        *version = line[7] == '0' ? HTTP_1_0 : HTTP_1_1;
+    else if (line[5] == '2')
+        *version = HTTP_2;
+    else
+        return -1;
+    *reason = len > 12 ? 13 : 12;
+    return (line[9] - '0') * 100 + (line[10] - '0') * 10 + (line[11] - '0');
+}
+
+/**
+ * The header block is complete: parse the status line and the fields
+ * deciding how the body is delimited, and hand the headers to the session.
+ * Interim responses (1xx) are dropped and parsing starts over.
+ */
+int __parser_headers(http_session http, struct http_parser *p)
+{
+    char *head = p->head;
+    size_t end = p->line;
+    long long length = -1;
+    int chunked = 0;
+
+    // The headers stop before the CRLF ending the last field
+    while (end && (head[end - 1] == '\n' || head[end - 1] == '\r'))
+        end--;
+    head[end] = 0;
+
+    size_t pos = __scan_lf(head, end);
+    size_t status_len = pos && head[pos - 1] == '\r' ? pos - 1 : pos;
+    enum http_version version;
+    size_t reason;
+    p->status = __parse_status_line(head, status_len, &version, &reason);
+    if (p->status < 0)
     {
-        __set_error_msg(http, "%s", __get_error_msg());
-        http->error_code = errno;
+        __set_error_msg(http, "Invalid response status line");
+        http->error_code = HTTP_INVALID_RESPONSE;
         return HTTP_ERROR;
     }
-
-    http->proxy_connected = 1;
-    freeaddrinfo(peer_addr);
-    http->proxy_socket = s;
-    if (!IsValidSocket(s))
+    if (p->status < 200 && p->status != 101)
     {
-        __set_error_msg(http, "%s", __get_error_msg());
-        http->error_code = errno;
-        return HTTP_ERROR;
+        p->head_len = p->line = 0;
+        return HTTP_OK;
     }
-    if (http->proxy_flag == HTTPS)
+
+    __header_index_begin(http);
+    struct http_header_index *x = &http->response.index;
+
+    while (pos < end)
     {
-        SSL *ssl_tmp;
-        SSL_CTX *ctx;
-        const SSL_METHOD *method;
-        switch (http->ssl.version)
-        {
-        case HTTP_TLS_1_0:
-            method = TLSv1_client_method();
-            break;
-        case HTTP_TLS_1_1:
-            method = TLSv1_1_client_method();
-            break;
-        case HTTP_TLS_1_2:
-            method = TLSv1_2_client_method();
-            break;
-        case HTTP_TLS_1_3:
-            method = TLS_client_method();
-            break;
-        default:
-            method = TLS_client_method();
-            break;
-        }
-        ctx = SSL_CTX_new(method);
-        // SSL_CTX_set_options(ctx, SSL_CTX_set_timeout(ctx, 0));
-        if (!ctx)
-        {
-            __set_error_msg(http, "SSL error\n");
-            http->error_code = HTTP_SSL_ERROR;
-            return HTTP_ERROR;
-        }
-        /**
-         * If the user requested to use http/2, then we use
-         * SSL_CTX to set the type of protocol we want to negotiate with the server
-         */
-        if (http->connection.version == HTTP_2)
+        char *line = head + pos + 1;
+        size_t len = __scan_lf(line, end - pos - 1);
+        pos += len + 1;
+        if (len && line[len - 1] == '\r')
+            len--;
+        size_t value_end = len;
+        while (value_end && (line[value_end - 1] == ' ' || line[value_end - 1] == '\t'))
+            value_end--;
+
+        // Continuation lines (obsolete folding) extend the previous value, joined with spaces
+        if (!len || line[0] == ' ' || line[0] == '\t')
         {
-            if (SSL_CTX_set_alpn_protos(ctx, (const unsigned char *)"\x02h2", 3) != 0)
+            if (x->count && value_end)
             {
-                __set_error_msg(http, "OpenSSL, ALPN: failed to set protocol 'h2'");
-                http->error_code = HTTP_SSL_ERROR;
-                return HTTP_ERROR;
+                struct http_field *f = &x->fields[x->count - 1];
+                f->value_len = (unsigned)(line + value_end - head) - f->value_off;
+                f->folded = 1;
             }
+            continue;
         }
 
-        ssl_tmp = SSL_new(ctx);
-        if (!ssl_tmp)
+        size_t name_len = __span_class(line, len, __token_class);
+        if (!name_len || line[name_len] != ':')
         {
-            __set_error_msg(http, "SSL error");
-            http->error_code = HTTP_SSL_ERROR;
-            SSL_CTX_free(ctx);
+            __set_error_msg(http, "Invalid header field in response");
+            http->error_code = HTTP_INVALID_RESPONSE;
             return HTTP_ERROR;
         }
-
-        if (!SSL_set_tlsext_host_name(ssl_tmp, http->connection.proxy.hostname))
-        {
-            SSL_CTX_free(ctx);
-            SSL_free(ssl_tmp);
+        const char *value = line + name_len + 1;
+        while (value < line + value_end && (*value == ' ' || *value == '\t'))
+            value++;
+        if (__header_index_add(http, line - head, name_len, value - head, line + value_end - value) != HTTP_OK)
             return HTTP_ERROR;
-        }
-        // SSL_set_timeout(http->ssl.ssl, 5);
-        // printf("Timeout %d\n", SSL_get_timeout(http->ssl.ssl));
-        SSL_set_fd(ssl_tmp, http->proxy_socket);
-        if (SSL_connect(ssl_tmp) == -1)
+        if (name_len == 14 && strncasecmp(line, "Content-Length", 14) == 0)
         {
-            SSL_CTX_free(ctx);
-            SSL_free(ssl_tmp);
-            __set_error_msg(http, "Failed to establish SSL/TLS connection");
-            http->error_code = HTTP_SSL_CONN_FAILED;
-            return HTTP_ERROR;
+            // Digits only, and repeated fields must agree, or the body boundary is ambiguous
+            long long n = 0;
+            const char *d = value;
+            for (; d < line + value_end && *d >= '0' && *d <= '9' && n <= (LLONG_MAX - 9) / 10; d++)
+                n = n * 10 + (*d - '0');
+            if (d == value || d != line + value_end || (length >= 0 && n != length))
+            {
+                __set_error_msg(http, "Invalid Content-Length in response");
+                http->error_code = HTTP_INVALID_RESPONSE;
+                return HTTP_ERROR;
+            }
+            length = n;
         }
-        http->ssl.proxy_ssl = ssl_tmp;
+        else if (name_len == 17 && strncasecmp(line, "Transfer-Encoding", 17) == 0)
+            chunked = __is_chunked(value, line + len - value);
+    }
 
-        /**
-         * Connection established, check if the user requested to use http/2
-         * and that Openssl has negotaited with the server
-         */
-        if (http->connection.version == HTTP_2)
-        {
-            const unsigned char *alpn = NULL;
-            int alpnlen = 0;
+    if (p->no_body || p->status == 101 || p->status == 204 || p->status == 304)
+        p->state = HTTP_PARSE_DONE;
+    else if (chunked)
+        p->state = HTTP_PARSE_CHUNK_SIZE;
+    else if (length >= 0)
+        p->state = length ? HTTP_PARSE_LENGTH : HTTP_PARSE_DONE;
+    else
+        p->state = HTTP_PARSE_CLOSE;
+    p->remaining = chunked ? 0 : length;
+    http->response.content_length = chunked ? -1 : length;
+    if (p->state == HTTP_PARSE_LENGTH && http->connection->max_response > 0 &&
+        length > http->connection->max_response)
+    {
+        __set_error_msg(http, "Response body is larger than %lld bytes", http->connection->max_response);
+        http->error_code = HTTP_RESPONSE_TOO_LARGE;
+        return HTTP_ERROR;
+    }
 
-#ifndef OPENSSL_NO_NEXTPROTONEG
-            SSL_get0_next_proto_negotiated(http->ssl.proxy_ssl, &alpn, &alpnlen);
-#endif
+    free(http->response.headers);
+    http->response.headers = head;
+    http->response.status = p->status;
+    http->response.version = version;
+    http->response.reason_off = reason;
+    http->response.reason_len = status_len - reason;
+    x->len = end;
+    p->head = NULL;
+    p->head_len = p->head_cap = p->line = 0;
+    p->head_done = 1;
+    return HTTP_OK;
+}
 
-            if (alpn == NULL)
-            {
-                SSL_get0_alpn_selected(http->ssl.proxy_ssl, &alpn, &alpnlen);
-            }
+// Malformed chunked framing
+long __parser_chunk_error(http_session http)
+{
+    __set_error_msg(http, "Invalid chunked encoding in response");
+    http->error_code = HTTP_INVALID_RESPONSE;
+    return HTTP_ERROR;
+}
 
-            if (alpn == NULL || alpnlen == 0 || memcmp("h2", alpn, 2) != 0)
+/**
+ * Parse len bytes of the response. Only the new bytes are looked at, and
+ * any split of the input is fine. Stops after the header block, so the
+ * caller can act on the headers before the body, at the end of the response,
+ * and when the write callback pauses (the paused bytes aren't consumed).
+ * @returns the number of bytes consumed, HTTP_ERROR on malformed responses
+ */
+long __parser_feed(http_session http, struct http_parser *p, const char *data, size_t len)
+{
+    size_t i = 0;
+    while (i < len && p->state != HTTP_PARSE_DONE)
+    {
+        switch (p->state)
+        {
+        case HTTP_PARSE_HEAD:
+        {
+            // Look for the empty line ending the header block, then copy the bytes in one go
+            size_t start = i;
+            int found = 0;
+            while (i < len)
             {
-                if (http->verbose == 1)
+                size_t lf = i + __scan_lf(data + i, len - i);
+                if (lf == len)
                 {
-                    lfprintf(http, "** ALPN: server does'nt accept to use h2, switching to http/1.1\n");
+                    i = len;
+                    break;
                 }
+                size_t pos = p->head_len + lf - start; // offset of the LF in head
+                char prev = lf > start ? data[lf - 1] : p->head_len ? p->head[p->head_len - 1] : 0;
+                i = lf + 1;
+                if (pos == p->line || (pos == p->line + 1 && prev == '\r'))
+                {
+                    found = 1;
+                    break;
+                }
+                p->line = pos + 1;
             }
-            else
+            size_t n = i - start;
+            if (p->head_len + n + 1 > p->head_cap)
             {
-                http->ssl.alpn_h2_negotiated = 1;
-                if (http->verbose == 1)
+                size_t cap = p->head_cap ? p->head_cap * 2 : 4096;
+                while (cap < p->head_len + n + 1)
+                    cap *= 2;
+                if (cap > HTTP_MAX_RESPONSE_HEADERS)
                 {
-                    lfprintf(http, "** ALPN: server accepted to use h2\n");
+                    __set_error_msg(http, "Response headers are too large");
+                    http->error_code = HTTP_INVALID_RESPONSE;
+                    return HTTP_ERROR;
                 }
-                const char *client_preface = "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n";
-                char read[1024];
-                SSL_write(http->ssl.proxy_ssl, client_preface, strlen(client_preface));
-                // SSL_write(http->ssl.ssl, "HTTP2-Settings: ENABLE_PUSH", 21);
-                int n = SSL_read(http->ssl.proxy_ssl, read, 1024);
-                if (n < 1)
+                char *head = (char *)realloc(p->head, cap);
+                if (!head)
                 {
-                    printf("Connection closed\n");
-                    exit(0);
+                    __set_error_msg(http, "%s", __get_error_msg());
+                    http->error_code = errno;
+                    return HTTP_ERROR;
                 }
-                printf("** Server preface: %.*s\n", n, read);
+                p->head = head;
+                p->head_cap = cap;
+            }
+            memcpy(p->head + p->head_len, data + start, n);
+            p->head_len += n;
+            if (found)
+            {
+                if (__parser_headers(http, p) != HTTP_OK)
+                    return HTTP_ERROR;
+                if (p->head_done)
+                    return (long)i;
             }
+            break;
         }
-        // Get the server certificate
-        X509 *cert = SSL_get_peer_certificate(http->ssl.proxy_ssl);
-        char *subject, *issuer;
-        if ((subject = strdup(X509_NAME_oneline(X509_get_subject_name(cert), 0, 0))) != NULL)
+        case HTTP_PARSE_LENGTH:
+        case HTTP_PARSE_CHUNK_DATA:
         {
-            http->ssl.cert_subject = strdup(subject);
-            OPENSSL_free(subject);
+            size_t n = len - i;
+            if ((long long)n > p->remaining)
+                n = (size_t)p->remaining;
+            int r = HTTP_OK;
+            if (p->discard)
+                p->drained += n;
+            else
+                r = __response_body_write(http, data + i, n);
+            if (r == HTTP_PAUSED)
+            {
+                p->paused = 1;
+                return (long)i;
+            }
+            if (r != HTTP_OK)
+                return HTTP_ERROR;
+            i += n;
+            p->remaining -= n;
+            if (p->remaining == 0)
+                p->state = p->state == HTTP_PARSE_LENGTH ? HTTP_PARSE_DONE : HTTP_PARSE_CHUNK_END;
+            break;
         }
-
-        if ((issuer = strdup(X509_NAME_oneline(X509_get_issuer_name(cert), 0, 0))) != NULL)
+        case HTTP_PARSE_CLOSE:
         {
-            http->ssl.cert_issuer = strdup(issuer);
-            OPENSSL_free(issuer);
+            int r = HTTP_OK;
+            if (p->discard)
+                p->drained += len - i;
+            else
+                r = __response_body_write(http, data + i, len - i);
+            if (r == HTTP_PAUSED)
+            {
+                p->paused = 1;
+                return (long)i;
+            }
+            if (r != HTTP_OK)
+                return HTTP_ERROR;
+            i = len;
+            break;
         }
-        long verify = SSL_get_verify_result(http->ssl.proxy_ssl);
-        if (http->verbose == 1)
+        case HTTP_PARSE_CHUNK_SIZE:
         {
-            lfprintf(http, "** certificate subject: %s\n", http_get_certificate_subject(http));
-            lfprintf(http, "** certificate issuer: %s\n", http_get_certificate_issuer(http));
-
-            if (verify == X509_V_OK)
-                lfprintf(http, "** certificate verification successful\n");
+            if (!p->digits)
+            {
+                // The whole size is in view: convert it at once
+                size_t n = __span_class(data + i, len - i, __hex_class);
+                if (n && n <= 15 && n < len - i)
+                {
+                    p->remaining = __hex_value(data + i, n);
+                    p->digits = (int)n;
+                    i += n;
+                    break;
+                }
+            }
+            char c = data[i++];
+            int v = c >= '0' && c <= '9' ? c - '0' : (c | 0x20) >= 'a' && (c | 0x20) <= 'f' ? (c | 0x20) - 'a' + 10 : -1;
+            if (v >= 0)
+            {
+                if (++p->digits > 15)
+                    return __parser_chunk_error(http);
+                p->remaining = p->remaining * 16 + v;
+            }
+            else if (!p->digits)
+                return __parser_chunk_error(http);
+            else if (c == ';' || c == ' ' || c == '\t')
+                p->state = HTTP_PARSE_CHUNK_EXT;
+            else if (c == '\n')
+                goto chunk_line_end;
+            else if (c == '\r')
+                p->state = HTTP_PARSE_CHUNK_SIZE_LF;
             else
-                lfprintf(http, "** certificate verification failed\n");
+                return __parser_chunk_error(http);
+            break;
+        }
+        case HTTP_PARSE_CHUNK_SIZE_LF:
+            // A bare CR can't be part of the size line
+            if (data[i++] != '\n')
+                return __parser_chunk_error(http);
+            goto chunk_line_end;
+        case HTTP_PARSE_CHUNK_EXT:
+        {
+            const char *nl = (const char *)memchr(data + i, '\n', len - i);
+            if (!nl)
+            {
+                i = len;
+                break;
+            }
+            i = nl - data + 1;
+        chunk_line_end:
+            p->digits = 0;
+            if (p->remaining)
+                p->state = HTTP_PARSE_CHUNK_DATA;
+            else
+            {
+                p->state = HTTP_PARSE_TRAILER;
+                p->trailer_len = 0;
+            }
+            break;
+        }
+        case HTTP_PARSE_CHUNK_END:
+        case HTTP_PARSE_CHUNK_END_LF:
+        {
+            char c = data[i++];
+            if (c == '\r' && p->state == HTTP_PARSE_CHUNK_END)
+                p->state = HTTP_PARSE_CHUNK_END_LF;
+            else if (c == '\n')
+            {
+                p->state = HTTP_PARSE_CHUNK_SIZE;
+                p->remaining = 0;
+            }
+            else
+                return __parser_chunk_error(http);
+            break;
+        }
+        case HTTP_PARSE_TRAILER:
+        {
+            char c = data[i++];
+            if (c == '\n')
+            {
+                if (!p->trailer_len)
+                    p->state = HTTP_PARSE_DONE;
+                p->trailer_len = 0;
+            }
+            else if (c != '\r')
+                p->trailer_len++;
+            break;
+        }
+        case HTTP_PARSE_DONE:
+            break;
         }
-        // unsigned char vectors[] = {
-        //     11, 'h', 't', 't', 'p', '/', '2'
-        // };
-        // unsigned int len = sizeof(vectors);
     }
-    return HTTP_OK;
+    return (long)i;
 }
 
-// Following redirects
-int __follow_redirect__(http_session http, char *location)
+/**
+ * Read what the connection has, waiting at most the response timeout
+ * @returns bytes read, 0 once the peer closed the connection, HTTP_ERROR
+ */
+int __recv_response(http_session http, int flag, char *buf, size_t size)
 {
+    HTTPSOCKET sock = flag ? http->proxy_socket : http->socket;
+    SSL *ssl = (flag ? http->proxy_flag : http->flag) == HTTPS
+                   ? (flag ? http->ssl.proxy_ssl : http->ssl.ssl)
+                   : NULL;
+    int n;
 
-    http->connection.url = location;
-    http->connection.hostname = "";
-    http->connection.port = "";
-    http->connection.path = "";
-    http->connection.query = "";
-
-    __parse_url(http, &http->connection.hostname, &http->connection.port,
-                &http->connection.path, &http->connection.query);
-    if (http_connect(http) != HTTP_OK)
+    for (;;)
     {
+        // Records OpenSSL already decrypted don't make the socket readable
+        if (!ssl || !SSL_pending(ssl))
+        {
+            fd_set reads;
+            struct timeval timeout;
+            int r = http->connection->res_timeout;
+            FD_ZERO(&reads);
+            FD_SET(sock, &reads);
+            timeout.tv_sec = r >= 1 ? r : RES_TIMEOUT;
+            timeout.tv_usec = 0;
+            n = select(sock + 1, &reads, 0, 0, &timeout);
+            if (n < 0)
+            {
+                __set_error_msg(http, "a call to select() failed");
+                return HTTP_ERROR;
+            }
+            if (n == 0)
+            {
+                __set_error_msg(http, "Response timed out after %.2fs", r >= 1 ? (double)r : RES_TIMEOUT);
+                http->error_code = HTTP_RES_TIMEOUT;
+                return HTTP_ERROR;
+            }
+        }
+
+        // Only an orderly shutdown ends the response, a reset or a failed read doesn't
+        if (!ssl)
+        {
+            n = recv(sock, buf, size, 0);
+            if (n >= 0)
+                return n;
+            if (errno == EINTR)
+                continue;
+            __set_error_msg(http, "Receiving the response failed: %s", __get_error_msg());
+            http->error_code = HTTP_CONNECTION_RESET;
+            return HTTP_ERROR;
+        }
+        n = SSL_read(ssl, buf, (int)size);
+        if (n > 0)
+            return n;
+        int err = SSL_get_error(ssl, n);
+        if (err == SSL_ERROR_ZERO_RETURN)
+            return 0;
+        if (err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE)
+            continue;
+        __set_error_msg(http, "SSL_read() failed, the connection wasn't shut down cleanly");
+        http->error_code = HTTP_SSL_ERROR;
         return HTTP_ERROR;
     }
-    if (http_session_start(http) != HTTP_OK)
-        return HTTP_ERROR;
-    http->connection.c_redirect_num += 1;
-    return HTTP_OK;
 }
 
-// following redirects for proxy connection
-
-int __follow_redirect_proxy__(http_session http, char *location)
+// Print received headers like sent ones when verbosity is enabled
+void __log_received(http_session http, const char *headers)
 {
-
-    http->connection.url = location;
-    http->connection.hostname = "";
-    http->connection.port = "";
-    http->connection.path = "";
-    http->connection.query = "";
-
-    __parse_url(http, &http->connection.hostname, &http->connection.port,
-                &http->connection.path, &http->connection.query);
-
-    if (http_proxy_session_start(http) != HTTP_OK)
-        return HTTP_ERROR;
-    http->connection.c_redirect_num += 1;
-    return HTTP_OK;
+    __log_sent(http, headers, strlen(headers));
 }
 
-// Wait for proxy server response
-int __wait_proxy_response(http_session http)
+// The header callback aborted the response, close the connection unless the body was drained
+int __response_aborted(http_session http, int flag, int close)
 {
-
-    char response[MAXRESPONSE + 1];
-    char *p = response, *q;
-    char *end = response + MAXRESPONSE;
-    char *body = 0;
-
-    enum
+    if (close && flag)
     {
-        length,
-        chunked,
-        connection
-    };
-    int encoding = 0;
-    int remaining = 0;
-
-    // time_t start;
-    // struct tm *start_tm, *end_tm;
-    // start = time(0);
-    // start_tm = localtime(&start);
-    // const int start_sec = start_tm->tm_sec;
-    while (1)
+        http_proxy_disconnect(http);
+        http->proxy_connected = 0;
+    }
+    else if (close)
     {
+        http_disconnect(http);
+        http->connected = 0;
+    }
+    __set_error_msg(http, "Response aborted by the header callback");
+    http->error_code = HTTP_ABORTED_BY_CALLBACK;
+    return HTTP_ERROR;
+}
+
+/**
+ * Read and parse the rest of the response on the server (flag 0) or proxy
+ * (flag 1) connection, following redirects
+ * @returns HTTP_PAUSED when the write callback paused, its bytes kept in preread
+ */
+int __read_response(http_session http, int flag, struct http_parser *parser)
+{
+    char buf[HTTP_RECV_BUFFER];
+    struct http_conn_info *c = http->connection;
 
-        fd_set reads;
-        FD_ZERO(&reads);
-        FD_SET(http->proxy_socket, &reads);
-        struct timeval timeout;
-        timeout.tv_sec = http->connection.res_timeout >= 1 ? http->connection.res_timeout : RES_TIMEOUT;
-        timeout.tv_usec = 0;
+    // Bytes read ahead (waiting for 100 Continue, or before a pause) are parsed first
+    size_t pending = http->preread_len;
+    http->preread_len = 0;
 
-        if (select(http->proxy_socket + 1, &reads, 0, 0, &timeout) < 0)
+    while (parser->state != HTTP_PARSE_DONE)
+    {
+        const char *data = http->preread;
+        long n = (long)pending;
+        if (pending)
+            pending = 0;
+        else
         {
-            __set_error_msg(http, "a call to select() failed");
+            data = buf;
+            n = __recv_response(http, flag, buf, sizeof(buf));
+        }
+        if (n < 0)
+            return HTTP_ERROR;
+        if (n == 0)
+        {
+            if (parser->state == HTTP_PARSE_CLOSE)
+                break;
+            __set_error_msg(http, "Connection closed by peer");
+            http->error_code = HTTP_CONNECTION_RESET;
             return HTTP_ERROR;
         }
+        __first_byte(http);
 
-        if (FD_ISSET(http->proxy_socket, &reads))
+        for (long off = 0; off < n && parser->state != HTTP_PARSE_DONE;)
         {
-            int bytes_received = 0;
-            if (http->proxy_flag == HTTPS)
-            {
-                bytes_received = SSL_read(http->ssl.proxy_ssl, p, end - p);
-            }
-            else
-            {
-                bytes_received = recv(http->proxy_socket, p, end - p, 0);
-            }
-            if (bytes_received < 1)
+            long used = __parser_feed(http, parser, data + off, n - off);
+            if (used < 0)
+                return HTTP_ERROR;
+            off += used;
+            if (parser->discard && parser->drained > c->drain_limit)
+                return __response_aborted(http, flag, 1);
+            if (parser->paused)
             {
-                if (encoding == connection && body)
+                if (!http->preread && !(http->preread = (char *)malloc(HTTP_RECV_BUFFER)))
                 {
-                    sprintf(http->response.body + strlen(http->response.body),
-                            "%.*s", (int)(end - body), body);
+                    __set_error_msg(http, "%s", __get_error_msg());
+                    http->error_code = errno;
+                    return HTTP_ERROR;
                 }
-                __set_error_msg(http, "connection closed by peer");
-                http->error_code = HTTP_CONNECTION_RESET;
-                break;
+                memmove(http->preread, data + off, n - off);
+                http->preread_len = n - off;
+                return HTTP_PAUSED;
             }
-            p += bytes_received;
-            *p = 0;
-            // printf("%s", response);
-            if (!body && strstr(response, "\r\n\r\n"))
+            if (!parser->head_done)
+                continue;
+            parser->head_done = 0;
+
+            // Redirects are followed as soon as their headers are in
+            const char *location = parser->status >= 300 && parser->status < 400
+                                       ? http_get_header(http, "Location")
+                                       : NULL;
+            if (location && c->redirects != HTTP_REDIRECTS_DISALLOW &&
+                (!flag || (c->max_redirect >= 1 && c->c_redirect_num <= c->max_redirect)))
             {
-
-                body = strdup(strstr(response, "\r\n\r\n"));
-                *body = 0;
-                body += 4;
-                char *headers = strdup(response);
-                char *k;
-                if ((k = strstr(headers, "\r\n\r\n")))
-                {
-                    *k = 0;
-                    http->response.headers = strdup(headers);
-                }
-                if (http->connection.redirects != HTTP_REDIRECTS_DISALLOW && http->connection.max_redirect >= 1 && http->connection.c_redirect_num <= http->connection.max_redirect)
-                {
-
-                    if (strstr(headers, "\nLocation: "))
-                    {
-
-                        char *x = strdup(http_get_header(http, "Location"));
-                        if (http->verbose == 1)
-                        {
-
-                            char *o = strdup(headers);
-                            fprintf(stdout, "<| ");
-                            while (*o)
-                            {
-                                if (*o == '\n')
-                                {
-                                    fprintf(stdout, "\n<| ");
-                                    *o++;
-                                }
-                                else
-                                {
-                                    fprintf(stdout, "%c", *o);
-                                    *o++;
-                                }
-                            }
-                            fprintf(stdout, "\n");
-                            if (http->lfp != NULL)
-                                fprintf(http->lfp, "%s", headers);
-                            lfprintf(http, "** Following %s ...\n", x);
-                        }
-                        if (__follow_redirect_proxy__(http, x) != HTTP_OK)
-                        {
-                            return HTTP_ERROR;
-                        }
-                    }
-                }
-                if (strstr(response, "\nContent-Length: "))
-                {
-                    q = strdup(strstr(response, "\nContent-Length: "));
-                    q = strchr(q, ' ');
-                    q += 1;
-                    encoding = length;
-                    remaining = strtol(q, 0, 10);
-                }
-                else if (strstr(response, "\nTransfer-Encoding: chunked"))
-                {
-                    encoding = chunked;
-                    remaining = 0;
-                }
-                else
+                char *x = strdup(location);
+                if (!flag)
+                    http_disconnect(http);
+                if (http->verbose == HTTP_VERBOSITY_ENABLE)
                 {
-                    encoding = connection;
+                    __log_received(http, http->response.headers);
+                    lfprintf(http, "** Following %s ...\n", x);
                 }
+                return flag ? __follow_redirect_proxy__(http, x) : __follow_redirect__(http, x);
             }
-            if (body)
+
+            // The caller may not want the body: drain it if that is cheap, close otherwise
+            if (c->header_cb && c->header_cb(http, parser->status, c->header_data) != HTTP_HEADER_CONTINUE)
             {
-                if (encoding == length)
-                {
-                    if (p - body >= remaining)
-                    {
-                        sprintf(http->response.body + strlen(http->response.body),
-                                "%.*s", remaining, body);
-                        break;
-                    }
-                }
-                else if (encoding == chunked)
-                {
-                    do
-                    {
-                        if (remaining == 0)
-                        {
-                            if ((q = strstr(body, "\r\n")))
-                            {
-                                remaining = strtol(body, 0, 16);
-                                if (!remaining)
-                                    return HTTP_OK;
-                                body = q + 2;
-                            }
-                            else
-                                return HTTP_OK;
-                        }
-                        if (remaining && p - body >= remaining)
-                        {
-                            sprintf(http->response.body + strlen(http->response.body),
-                                    "%.*s", remaining, body);
-                            body += remaining + 2;
-                            remaining = 0;
-                        }
-                    } while (!remaining);
-                }
-            } // if(body)
-        } // if(FD_ISSET)
-        else
+                if (parser->state == HTTP_PARSE_CLOSE ||
+                    (parser->state == HTTP_PARSE_LENGTH && parser->remaining > c->drain_limit) ||
+                    (parser->state != HTTP_PARSE_DONE && c->drain_limit <= 0))
+                    return __response_aborted(http, flag, 1);
+                parser->discard = 1;
+            }
+        }
+    }
+    if (parser->discard)
+        return __response_aborted(http, flag, 0);
+    return HTTP_OK;
+}
+
+// Read the response to the request just sent, keeping the parser if it is paused
+int __wait_response_on(http_session http, int flag)
+{
+    struct http_parser parser;
+
+    __response_body_reset(http);
+    __parser_init(&parser, http->connection->method == HTTP_HEAD);
+
+    int ret = __read_response(http, flag, &parser);
+    if (ret == HTTP_PAUSED && parser.paused)
+    {
+        if (!(http->paused = (struct http_parser *)malloc(sizeof(parser))))
         {
-            int r = http->connection.res_timeout;
-            __set_error_msg(http, "Response timed out after %.2fs", r >= 1 ? r : RES_TIMEOUT);
-            http->error_code = HTTP_RES_TIMEOUT;
+            __parser_free(&parser);
+            __set_error_msg(http, "%s", __get_error_msg());
+            http->error_code = errno;
             return HTTP_ERROR;
         }
-    } // while(1)
+        *http->paused = parser;
+        http->paused_flag = flag;
+        return HTTP_PAUSED;
+    }
+    __parser_free(&parser);
+    return ret;
+}
 
-    return HTTP_OK;
+// Forget a paused response, its connection is left in the middle of it
+void __paused_free(http_session http)
+{
+    if (!http->paused)
+        return;
+    __parser_free(http->paused);
+    free(http->paused);
+    http->paused = NULL;
+    http->preread_len = 0;
+}
+
+// A new request can't be sent in the middle of a paused response, reconnect first
+void __paused_drop(http_session http)
+{
+    if (!http->paused)
+        return;
+    if (http->paused_flag)
+        http->proxy_connected = 0;
+    else
+        http->connected = 0;
+    __paused_free(http);
+}
+
+/**
+ * Go on reading a response paused by the write callback, starting with the
+ * body bytes it paused on
+ * @returns HTTP_OK, HTTP_PAUSED if it pauses again, HTTP_ERROR
+ */
+int http_resume(http_session http)
+{
+    struct http_parser *p = http->paused;
+    if (!p)
+    {
+        __set_error_msg(http, "No paused response");
+        http->error_code = HTTP_INVALID_OPTION;
+        return HTTP_ERROR;
+    }
+    http->paused = NULL;
+    p->paused = 0;
+
+    int flag = http->paused_flag;
+    int ret = __read_response(http, flag, p);
+    if (ret == HTTP_PAUSED && p->paused)
+    {
+        http->paused = p;
+        return HTTP_PAUSED;
+    }
+    __parser_free(p);
+    free(p);
+    if (ret == HTTP_OK && http->body_skipped)
+    {
+        if (flag)
+            http->proxy_connected = 0;
+        else
+            http->connected = 0;
+    }
+    return ret;
+}
+
+// Seconds from sending the last request to the first byte of its response, -1 if none came
+double http_get_ttfb(http_session http)
+{
+    return http->ttfb;
+}
+
+// Content-Length of the last response, -1 if it had none (chunked or close-delimited)
+long long http_get_content_length(http_session http)
+{
+    return http->response.content_length;
+}
+
+// Whether the last response was paused by the write callback
+int http_is_paused(http_session http)
+{
+    return http->paused != NULL;
+}
+
+// Wait for proxy server response
+int __wait_proxy_response(http_session http)
+{
+    return __wait_response_on(http, 1);
 }
 
 // Sending http CONNECT request method to the server
@@ -2323,7 +5222,7 @@ int http_proxy_send_request(http_session http)
         http->error_code = HTTP_FD_NOT_CONNECTED;
         return HTTP_ERROR;
     }
-    if (!http->connection.url && !http->connection.hostname && !http->connection.port)
+    if (!http->connection->url && !http->connection->hostname && !http->connection->port)
     {
         __set_error_msg(http, "Proxy error: no target url");
         http->error_code = HTTP_PROXY_NO_URL;
@@ -2334,47 +5233,42 @@ int http_proxy_send_request(http_session http)
         return HTTP_ERROR;
     }
 
-    while (1)
+    // The reply to CONNECT has no body: parse its header block like any response
+    struct http_parser parser;
+    char buf[HTTP_RECV_BUFFER];
+    __response_body_reset(http);
+    __parser_init(&parser, 1);
+    while (parser.state != HTTP_PARSE_DONE)
     {
-        fd_set proxy_fd;
-        FD_ZERO(&proxy_fd);
-        FD_SET(http->proxy_socket, &proxy_fd);
-
-        struct timeval timeout;
-
-        timeout.tv_sec = RES_TIMEOUT;
-        timeout.tv_usec = 0;
-        select(http->proxy_socket + 1, &proxy_fd, 0, 0, &timeout);
-        if (FD_ISSET(http->proxy_socket, &proxy_fd))
+        long n = __recv_response(http, 1, buf, sizeof(buf));
+        if (n == 0)
         {
-            char response[MAXRESPONSE];
-            int bytes_received = 0;
-
-            if (http->proxy_flag == HTTPS)
-            {
-                bytes_received = SSL_read(http->ssl.proxy_ssl, response, MAXRESPONSE);
-            }
-            else
-            {
-                bytes_received = recv(http->proxy_socket, response, MAXRESPONSE, 0);
-            }
-            if (bytes_received < 1)
-            {
-                __set_error_msg(http, "Connection closed by peer");
-                http->error_code = HTTP_CONNECTION_RESET;
-                return HTTP_ERROR;
-            }
-            http->response.headers = response;
-            http->connection.proxy.http_send_request_flag = 1;
-            break;
+            __set_error_msg(http, "Connection closed by peer");
+            http->error_code = HTTP_CONNECTION_RESET;
         }
-        else
+        long used = n > 0 ? __parser_feed(http, &parser, buf, n) : HTTP_ERROR;
+        if (used < 0)
         {
-            __set_error_msg(http, "Response timed out after %.2fs", RES_TIMEOUT);
-            http->error_code = HTTP_RES_TIMEOUT;
+            __parser_free(&parser);
             return HTTP_ERROR;
         }
+        // Whatever followed the header block already belongs to the tunnel
+        if (used < n)
+        {
+            if (!http->preread && !(http->preread = (char *)malloc(HTTP_RECV_BUFFER)))
+            {
+                __parser_free(&parser);
+                __set_error_msg(http, "%s", __get_error_msg());
+                http->error_code = errno;
+                return HTTP_ERROR;
+            }
+            memcpy(http->preread, buf + used, n - used);
+            http->preread_len = n - used;
+        }
     }
+    __parser_free(&parser);
+    if (__conn_mut(http) == HTTP_OK)
+        http->connection->proxy.http_send_request_flag = 1;
 
     return HTTP_OK;
 }
@@ -2383,6 +5277,7 @@ int http_proxy_send_request(http_session http)
 int http_proxy_session_start(http_session http)
 {
 
+    __paused_drop(http);
     if (!http->proxy_connected)
     {
         __set_error_msg(http, "Sockets ends not connected");
@@ -2390,222 +5285,273 @@ int http_proxy_session_start(http_session http)
         return HTTP_ERROR;
     }
 
-    if (__send_request_headers(http, 1) != HTTP_OK)
+    if (__send_request(http, 1) != HTTP_OK)
     {
         return HTTP_ERROR;
     }
 
-    enum http_requests r = http->connection.method;
+    // if (strlen(http->response.headers) >= 1)
+    //     memset(http->response.headers, 0, sizeof(http->response.headers));
+
+    // if (strlen(http->response.body) >= 1)
+    //     memset(http->response.body, 0, sizeof(http->response.body));
+    int ret = __wait_proxy_response(http);
+    if (ret != HTTP_OK)
+        return ret;
+    // The server still expects the body we didn't send, the connection is done
+    if (http->body_skipped)
+        http->proxy_connected = 0;
+
+    return HTTP_OK;
+}
+
+// Wait for server response
+int __wait_response(http_session http)
+{
+    return __wait_response_on(http, 0);
+}
+
+/**
+ * Function for starting a http request session
+ * @param http_session -> the http_session structure
+ */
+int http_session_start(http_session http)
+{
 
-    if (r == HTTP_POST || r == HTTP_PUT || r == HTTP_PATCH)
+    // Make sure the socket is connected to the server
+    __paused_drop(http);
+    if (!http->connected)
     {
-        if (__send_request_body(http, 1) != HTTP_OK)
-        {
-            return HTTP_ERROR;
-        }
+        __set_error_msg(http, "Sockets ends not connected");
+        http->error_code = HTTP_FD_NOT_CONNECTED;
+        return HTTP_ERROR;
     }
 
+    // send the request line, headers and the body of POST, PUT and PATCH
+    if (__send_request(http, 0) != HTTP_OK)
+    {
+        return HTTP_ERROR;
+    }
     // if (strlen(http->response.headers) >= 1)
     //     memset(http->response.headers, 0, sizeof(http->response.headers));
 
     // if (strlen(http->response.body) >= 1)
-    //     memset(http->response.body, 0, sizeof(http->response.body));
-    if (__wait_proxy_response(http) != HTTP_OK)
+    //     memset(http->response.headers, 0, sizeof(http->response.body));
+    // wait for response
+    int ret = __wait_response(http);
+    if (ret != HTTP_OK)
+        return ret;
+    // The server still expects the body we didn't send, the connection is done
+    if (http->body_skipped)
+        http->connected = 0;
+    return HTTP_OK;
+}
+
+/* A request serialized once and re-sent with only the target and a few headers patched */
+struct http_prepared_request_struct
+{
+    char *buf;
+    size_t len;
+    size_t cap;
+    size_t target_off;
+    size_t target_len;
+    struct
     {
-        return HTTP_ERROR;
+        char name[64];
+        size_t name_len;
+        size_t off;
+        size_t len;
+    } slots[HTTP_PREPARED_MAX_SLOTS];
+    int nslots;
+};
+
+/**
+ * Serialize the request described by the session options (request line,
+ * headers and body) once, so it can be sent many times
+ * @returns a prepared request, free it with http_prepared_free()
+ */
+http_prepared_request http_prepare_request(http_session http)
+{
+    if (__body_streamed(http))
+    {
+        __set_error_msg(http, "Streamed bodies can't be prepared");
+        http->error_code = HTTP_INVALID_OPTION;
+        return NULL;
     }
+    if (__construct_request_headers(http) != HTTP_OK)
+        return NULL;
 
-    return HTTP_OK;
+    size_t body_len = 0;
+    const char *body = __request_body(http, &body_len);
+    size_t len = http->req_len + body_len;
+
+    http_prepared_request req = (http_prepared_request)calloc(1, sizeof(*req));
+    if (!req)
+        return NULL;
+    // Leave room so patching the target or a header rarely needs to grow
+    req->cap = len + HTTP_PREPARED_SLACK;
+    req->buf = (char *)malloc(req->cap);
+    if (!req->buf)
+    {
+        free(req);
+        return NULL;
+    }
+    memcpy(req->buf, http->req_headers, http->req_len);
+    if (body_len)
+        memcpy(req->buf + http->req_len, body, body_len);
+    req->len = len;
+
+    // The target starts after "METHOD /" and ends at the next space
+    const char *sp = memchr(req->buf, ' ', len);
+    req->target_off = sp - req->buf + 2;
+    const char *end = memchr(req->buf + req->target_off, ' ', len - req->target_off);
+    req->target_len = end - (req->buf + req->target_off);
+    return req;
 }
 
-// Wait for server response
-int __wait_response(http_session http)
+void http_prepared_free(http_prepared_request req)
 {
+    if (!req)
+        return;
+    free(req->buf);
+    free(req);
+}
 
-    char response[MAXRESPONSE + 1];
-    char *p = response, *q;
-    char *end = response + MAXRESPONSE;
-    char *body = 0;
+// Resize the region [off, off + old_len) to new_len bytes, moving the rest of the request
+int __prepared_resize(http_prepared_request req, size_t off, size_t old_len, size_t new_len)
+{
+    if (new_len == old_len)
+        return HTTP_OK;
 
-    enum
+    size_t len = req->len - old_len + new_len;
+    if (len > req->cap)
     {
-        length,
-        chunked,
-        connection
-    };
-    int encoding = 0;
-    int remaining = 0;
+        size_t cap = len + HTTP_PREPARED_SLACK;
+        char *buf = (char *)realloc(req->buf, cap);
+        if (!buf)
+            return HTTP_ERROR;
+        req->buf = buf;
+        req->cap = cap;
+    }
+    memmove(req->buf + off + new_len, req->buf + off + old_len, req->len - off - old_len);
+    req->len = len;
 
-    while (1)
+    for (int i = 0; i < req->nslots; i++)
     {
-        fd_set reads;
+        if (req->slots[i].off > off)
+            req->slots[i].off += new_len - old_len;
+    }
+    return HTTP_OK;
+}
+
+/**
+ * Replace the request target
+ * @param path the path, with or without the leading '/'
+ * @param query the query string without '?', or NULL for none
+ */
+int http_prepared_set_target(http_prepared_request req, const char *path, const char *query)
+{
+    if (!req || !path)
+        return HTTP_ERROR;
+    if (*path == '/')
+        path++;
+
+    size_t path_len = strlen(path);
+    size_t query_len = query ? strlen(query) : 0;
+    size_t len = path_len + (query ? query_len + 1 : 0);
+    if (strpbrk(path, " \r\n") || (query && strpbrk(query, " \r\n")))
+        return HTTP_ERROR;
 
-        FD_ZERO(&reads);
-        FD_SET(http->socket, &reads);
-        struct timeval timeout;
-        timeout.tv_sec = http->connection.res_timeout >= 1 ? http->connection.res_timeout : RES_TIMEOUT;
-        timeout.tv_usec = 0;
+    if (__prepared_resize(req, req->target_off, req->target_len, len) != HTTP_OK)
+        return HTTP_ERROR;
+
+    char *p = req->buf + req->target_off;
+    memcpy(p, path, path_len);
+    if (query)
+    {
+        p[path_len] = '?';
+        memcpy(p + path_len + 1, query, query_len);
+    }
+    req->target_len = len;
+    return HTTP_OK;
+}
 
-        if (select(http->socket + 1, &reads, 0, 0, &timeout) < 0)
+// Locate the value of a header in the serialized request, the lookup is cached in a slot
+int __prepared_find_header(http_prepared_request req, const char *name, size_t name_len,
+                           size_t *off, size_t *len, int *slot)
+{
+    for (int i = 0; i < req->nslots; i++)
+    {
+        if (req->slots[i].name_len == name_len && __strncaseeq(req->slots[i].name, name, name_len))
         {
-            __set_error_msg(http, "a call to select() failed");
-            return HTTP_ERROR;
+            *off = req->slots[i].off;
+            *len = req->slots[i].len;
+            *slot = i;
+            return HTTP_OK;
         }
+    }
 
-        if (FD_ISSET(http->socket, &reads))
+    // Walk the header lines, the request line comes first
+    const char *p = memchr(req->buf, '\n', req->len);
+    const char *end = req->buf + req->len;
+    while (p && p + 1 < end && p[1] != '\r' && p[1] != '\n')
+    {
+        const char *line = p + 1;
+        const char *eol = memchr(line, '\n', end - line);
+        if (!eol)
+            break;
+        if (line + name_len < eol && line[name_len] == ':' && __strncaseeq(line, name, name_len))
         {
-            int bytes_received;
-            if (http->flag == HTTPS)
+            const char *value = line + name_len + 1;
+            while (value < eol && (*value == ' ' || *value == '\t'))
+                value++;
+            *off = value - req->buf;
+            *len = eol - value - (eol[-1] == '\r');
+            *slot = -1;
+            if (req->nslots < HTTP_PREPARED_MAX_SLOTS && name_len < sizeof(req->slots[0].name))
             {
-                bytes_received = SSL_read(http->ssl.ssl, p, end - p);
-            }
-            else
-            {
-                bytes_received = recv(http->socket, p, end - p, 0);
-            }
-            if (bytes_received < 1)
-            {
-                if (encoding == connection && body)
-                {
-                    sprintf(http->response.body + strlen(http->response.body),
-                            "%.*s", (int)(end - body), body);
-                }
-                __set_error_msg(http, "Connection closed by peer");
-                http->error_code = HTTP_CONNECTION_RESET;
-                break;
+                *slot = req->nslots++;
+                memcpy(req->slots[*slot].name, name, name_len);
+                req->slots[*slot].name_len = name_len;
+                req->slots[*slot].off = *off;
+                req->slots[*slot].len = *len;
             }
-            printf("%s", p);
-            p += bytes_received;
-            *p = 0;
-            if (!body && strstr(response, "\r\n\r\n"))
-            {
+            return HTTP_OK;
+        }
+        p = eol;
+    }
+    return HTTP_ERROR;
+}
 
-                body = strdup(strstr(response, "\r\n\r\n"));
-                *body = 0;
-                body += 4;
-                char *headers = strdup(response);
-                char *k;
-                if ((k = strstr(headers, "\r\n\r\n")))
-                {
-                    *k = 0;
-                    http->response.headers = strdup(headers);
-                }
-                if (http->connection.redirects != HTTP_REDIRECTS_DISALLOW)
-                {
+/**
+ * Replace the value of a header that was part of the request when it was prepared
+ * @returns HTTP_ERROR if the header isn't in the request or the value is invalid
+ */
+int http_prepared_set_header(http_prepared_request req, const char *name, const char *value)
+{
+    if (!req || !name || !value || strpbrk(value, "\r\n"))
+        return HTTP_ERROR;
 
-                    if (strstr(headers, "\nLocation: "))
-                    {
-
-                        http_disconnect(http);
-
-                        char *x = strdup(http_get_header(http, "Location"));
-                        if (http->verbose == 1)
-                        {
-
-                            char *o = strdup(headers);
-                            fprintf(stdout, "<| ");
-                            while (*o)
-                            {
-                                if (*o == '\n')
-                                {
-                                    fprintf(stdout, "\n<| ");
-                                    *o++;
-                                }
-                                else
-                                {
-                                    fprintf(stdout, "%c", *o);
-                                    *o++;
-                                }
-                            }
-                            fprintf(stdout, "\n");
-                            if (http->lfp != NULL)
-                                fprintf(http->lfp, "%s", headers);
-                            lfprintf(http, "** Following %s ...\n", x);
-                        }
-                        if (__follow_redirect__(http, x) != HTTP_OK)
-                        {
-                            return HTTP_ERROR;
-                        }
-                    }
-                }
-                if (strstr(response, "\nContent-Length: "))
-                {
-                    q = strdup(strstr(response, "\nContent-Length: "));
-                    q = strchr(q, ' ');
-                    q += 1;
-                    encoding = length;
-                    remaining = strtol(q, 0, 10);
-                    // printf("Remaining: %d\n", remaining);
-                }
-                else if (strstr(response, "\nTransfer-Encoding: chunked"))
-                {
-                    encoding = chunked;
-                    remaining = 0;
-                }
-                else
-                {
-                    encoding = connection;
-                }
-            }
-            if (body)
-            {
-                if (encoding == length)
-                {
-                    // printf("p - body %d\n", (p - body));
-                    if (p - body <= remaining)
-                    {
-                        sprintf(http->response.body + strlen(http->response.body),
-                                "%.*s", remaining, body);
-                        break;
-                    }
-                }
-                else if (encoding == chunked)
-                {
-                    do
-                    {
-                        if (remaining == 0)
-                        {
-                            if ((q = strstr(body, "\r\n")))
-                            {
-                                remaining = strtol(body, 0, 16);
-                                if (!remaining)
-                                    return HTTP_OK;
-                                body = q + 2;
-                            }
-                            else
-                                return HTTP_OK;
-                        }
-                        if (remaining && p - body >= remaining)
-                        {
-                            sprintf(http->response.body + strlen(http->response.body),
-                                    "%.*s", remaining, body);
-                            body += remaining + 2;
-                            remaining = 0;
-                        }
-                    } while (!remaining);
-                }
-            } // if(body)
-        } // if(FD_ISSET)
-        else
-        {
-            int r = http->connection.res_timeout;
-            __set_error_msg(http, "Response timed out after %.2fs", r >= 1 ? r : RES_TIMEOUT);
-            http->error_code = HTTP_RES_TIMEOUT;
-            return HTTP_ERROR;
-        }
-    } // while(1)
+    size_t off, len, value_len = strlen(value);
+    int slot;
+    if (__prepared_find_header(req, name, strlen(name), &off, &len, &slot) != HTTP_OK)
+        return HTTP_ERROR;
 
+    if (__prepared_resize(req, off, len, value_len) != HTTP_OK)
+        return HTTP_ERROR;
+    memcpy(req->buf + off, value, value_len);
+    if (slot >= 0)
+        req->slots[slot].len = value_len;
     return HTTP_OK;
 }
 
 /**
- * Function for starting a http request session
- * @param http_session -> the http_session structure
+ * Send an already serialized request (request line, headers and body)
+ * on a connected session and wait for the response
  */
-int http_session_start(http_session http)
+int http_session_send_raw(http_session http, const char *request, size_t len)
 {
-
-    // Make sure the socket is connected to the server
+    __paused_drop(http);
     if (!http->connected)
     {
         __set_error_msg(http, "Sockets ends not connected");
@@ -2613,36 +5559,21 @@ int http_session_start(http_session http)
         return HTTP_ERROR;
     }
 
-    // send the request headers
-    if (__send_request_headers(http, 0) != HTTP_OK)
-    {
+    __request_started(http);
+    if (__send_buffer(http, 0, request, len) != HTTP_OK)
         return HTTP_ERROR;
-    }
+    __log_sent(http, request, len);
 
-    /**
-     * Check to see if the request method is POST, PUT or PATCH
-     * we need to check if the request body is available,
-     * we need to send them
-     */
-    enum http_requests r = http->connection.method;
-    if (r == HTTP_POST || r == HTTP_PUT || r == HTTP_PATCH)
-    {
-        if (__send_request_body(http, 0) != HTTP_OK)
-        {
-            return HTTP_ERROR;
-        }
-    }
-    // if (strlen(http->response.headers) >= 1)
-    //     memset(http->response.headers, 0, sizeof(http->response.headers));
+    return __wait_response(http);
+}
 
-    // if (strlen(http->response.body) >= 1)
-    //     memset(http->response.headers, 0, sizeof(http->response.body));
-    // wait for response
-    if (__wait_response(http) != HTTP_OK)
-    {
-        return HTTP_ERROR;
-    }
-    return HTTP_OK;
+/**
+ * Send a prepared request on a connected session and wait for the response.
+ * The request goes out in a single write without building anything.
+ */
+int http_prepared_send(http_session http, http_prepared_request req)
+{
+    return http_session_send_raw(http, req->buf, req->len);
 }
 
 /**
@@ -2659,12 +5590,7 @@ int http_perform_req(http_session http)
         return HTTP_ERROR;
     }
 
-    if (http_session_start(http) != HTTP_OK)
-    {
-        return HTTP_ERROR;
-    }
-
-    return HTTP_OK;
+    return http_session_start(http);
 };
 
 /**
@@ -2696,8 +5622,9 @@ int http_proxy_perform_req(http_session http)
 void http_write_res_fp(http_session http, FILE *fp)
 {
 
-    if (http_get_headers(http) && http_get_body(http))
-        fprintf(fp, "%s%s", http_get_headers(http), http_get_body(http));
+    if (http_get_headers(http))
+        fprintf(fp, "%s", http_get_headers(http));
+    http_write_res_body_fp(http, fp);
 }
 
 /**
@@ -2719,8 +5646,8 @@ void http_write_res_headers_fp(http_session http, FILE *fp)
  */
 void http_write_res_body_fp(http_session http, FILE *fp)
 {
-    if (http_get_body(http))
-        fprintf(fp, "%s", http_get_body(http));
+    for (struct http_body_chunk *c = http->response.body; c; c = c->next)
+        fwrite(c->data, 1, c->len, fp);
 }
 
 /**
@@ -2733,7 +5660,8 @@ void http_write_res_body_fp_friendly(http_session http, FILE *fp)
 {
 
     // copy the response body to tmp
-    char *tmp = strdup(http_get_body(http));
+    const char *body = http_get_body(http);
+    char *tmp = body ? strdup(body) : NULL;
 
     // if no response body, return the function
     if (!tmp)
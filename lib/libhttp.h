@@ -79,9 +79,84 @@ enum http_options {
     HTTP_OPTIONS_CONTENT_TYPE_HEADER,      
     HTTP_OPTIONS_RESPONSE_TIMEOUT,
     HTTP_OPTIONS_LOGGING_FP,         // A file describtor to log all session
-    HTTP_OPTIONS_MAX_REDIRECT        // Maximum redirects to follow  
+    HTTP_OPTIONS_MAX_REDIRECT,       // Maximum redirects to follow  
+    /**
+     * Stream the POST, PUT or PATCH body from a callback, type of (http_read_callback).
+     * The body is sent with Transfer-Encoding: chunked unless HTTP_OPTIONS_BODY_SIZE is set
+    */
+    HTTP_OPTIONS_BODY_READ_CALLBACK,
+    HTTP_OPTIONS_BODY_READ_DATA,     // userdata passed to the read callback
+    HTTP_OPTIONS_BODY_SIZE,          // Size of the streamed body, type of (long *), sent as Content-Length
+    HTTP_OPTIONS_KTLS,               // Kernel TLS offload, type of (enum http_ktls)
+    HTTP_OPTIONS_ZEROCOPY,           // MSG_ZEROCOPY for large plain HTTP bodies, type of (enum http_zerocopy)
+    HTTP_OPTIONS_BODY_FILE_MODE,     // How *_BODY_FILE files are sent, type of (enum http_body_file_mode)
+    /**
+     * Number of buffers (2 to 16, type of long) a helper thread reads ahead
+     * when a body file is sent through reads, 0 to read inline (default)
+    */
+    HTTP_OPTIONS_BODY_READ_AHEAD,
+    /**
+     * Send a multipart/form-data body built with http_mime_*(), type of (http_mime).
+     * The form isn't copied and must outlive the requests using it
+    */
+    HTTP_OPTIONS_MIME,
+    /**
+     * Compress POST, PUT and PATCH bodies on the fly, type of (enum http_body_encoding).
+     * Compressed bodies are sent chunked with a Content-Encoding header
+    */
+    HTTP_OPTIONS_BODY_ENCODING,
+    HTTP_OPTIONS_BODY_ENCODING_LEVEL, // Compression level, type of long, 0 for the library default
+    /**
+     * Send "Expect: 100-continue" with bodies of at least this many bytes (type of long)
+     * and with bodies of unknown size, 0 to never send it (default). The body is only sent
+     * once the server answers 100 Continue or the timeout expires, and not at all if it
+     * answers with a final status
+    */
+    HTTP_OPTIONS_EXPECT_CONTINUE,
+    HTTP_OPTIONS_EXPECT_CONTINUE_TIMEOUT, // Milliseconds to wait for 100 Continue, type of long, default 1000
+    /**
+     * Largest response body accepted, type of long, 0 for no limit (default).
+     * Larger responses fail with HTTP_RESPONSE_TOO_LARGE
+    */
+    HTTP_OPTIONS_MAX_RESPONSE_SIZE,
+    /**
+     * Receive the response body through a callback instead of keeping it in the
+     * session, type of (http_write_callback). It gets the body as it arrives,
+     * after chunked decoding, so memory use doesn't depend on the body size
+    */
+    HTTP_OPTIONS_BODY_WRITE_CALLBACK,
+    HTTP_OPTIONS_BODY_WRITE_DATA,    // userdata passed to the write callback
+    /**
+     * Called once the final response headers are in, before any body byte is read,
+     * type of (http_header_callback). Returning HTTP_HEADER_ABORT fails the request
+     * with HTTP_ABORTED_BY_CALLBACK without reading the body
+    */
+    HTTP_OPTIONS_HEADER_CALLBACK,
+    HTTP_OPTIONS_HEADER_DATA,        // userdata passed to the header callback
+    /**
+     * After HTTP_HEADER_ABORT, read and drop bodies of up to this many bytes (type of long)
+     * to keep the connection; larger ones, and all with 0 (default), close it
+    */
+    HTTP_OPTIONS_ABORT_DRAIN_LIMIT
 };
 
+/**
+ * Body read callback, fill buffer with at most size bytes.
+ * Return the number of bytes written, 0 at the end of the body
+ * or HTTP_READ_ABORT to abort the request
+ */
+typedef size_t (*http_read_callback)(char *buffer, size_t size, void *userdata);
+# define HTTP_READ_ABORT ((size_t)-1)
+
+/**
+ * Response body write callback, called with each piece of the body.
+ * Return len to go on, HTTP_WRITE_PAUSE to stop reading until http_resume()
+ * (the same piece is passed again then), anything else aborts the request
+*/
+typedef size_t (*http_write_callback)(const char *data, size_t len, void *userdata);
+# define HTTP_WRITE_ABORT ((size_t)-1)
+# define HTTP_WRITE_PAUSE ((size_t)-2)
+
 /* HTTP proxy options */
 // enum http_proxy_options {
     
@@ -109,6 +184,35 @@ enum http_redirects {
     HTTP_REDIRECTS_DISALLOW,
 };
 
+/* Kernel TLS offload (Linux, OpenSSL 3 built with kTLS) */
+enum http_ktls {
+    HTTP_KTLS_ENABLE = 1,           // let the kernel encrypt and decrypt records when it accepts the keys
+    HTTP_KTLS_DISABLE               // (default)
+};
+
+/* Directions reported by http_get_ktls() */
+# define HTTP_KTLS_TX 0x01
+# define HTTP_KTLS_RX 0x02
+
+/* MSG_ZEROCOPY sends (Linux) */
+enum http_zerocopy {
+    HTTP_ZEROCOPY_ENABLE = 1,       // send in-memory bodies of 64 KiB and more from the caller's pages
+    HTTP_ZEROCOPY_DISABLE           // (default)
+};
+
+/* How body files are sent */
+enum http_body_file_mode {
+    HTTP_BODY_FILE_AUTO = 1,        // sendfile() for HTTP and kTLS, reads otherwise (default)
+    HTTP_BODY_FILE_MMAP             // send from a sequential mapping of the file, no read() copy
+};
+
+/* Request body Content-Encoding */
+enum http_body_encoding {
+    HTTP_BODY_ENCODING_IDENTITY = 1, // send the body as is (default)
+    HTTP_BODY_ENCODING_GZIP,         // gzip, levels 1 to 9
+    HTTP_BODY_ENCODING_ZSTD          // zstd, levels 1 to 19, only when built with LIBHTTP_WITH_ZSTD
+};
+
 /* Verbositiy */
 enum http_verbosity {
     HTTP_VERBOSITY_ENABLE = 1,        // enable verbosity
@@ -123,6 +227,23 @@ enum http_verbosity {
 
 
 typedef struct http_session_struct *http_session;
+typedef struct http_prepared_request_struct *http_prepared_request;
+typedef struct http_mime_struct *http_mime;
+
+/**
+ * Header callback, called with the status of the final response once its
+ * headers are parsed (http_get_header() and friends work). Returns
+ * HTTP_HEADER_CONTINUE to read the body or HTTP_HEADER_ABORT to skip it
+*/
+typedef int (*http_header_callback)(http_session http, int status, void *userdata);
+# define HTTP_HEADER_CONTINUE 0
+# define HTTP_HEADER_ABORT 1
+
+/* A piece of the response body, pointing into the session's receive buffers */
+struct http_body_segment {
+    const char *data;
+    size_t len;
+};
 
 /**
   * @brief Allocate a new http_session strucutre
@@ -132,6 +253,7 @@ http_session http_new(void);
 void http_free(http_session http);
 void http_disconnect(http_session http);
 void http_proxy_disconnect(http_session http);
+http_session http_clone(http_session src);
 void http_options_copy(http_session dest, http_session src);
 void http_write_res_fp(http_session http, FILE *fp);
 void http_write_res_body_fp(http_session http, FILE *fp);
@@ -144,19 +266,63 @@ void LIBHTTP_free(void *target);
 int  http_userauth_basic(http_session http, const char *username, const char *password); // COMING SOON
 int  http_options_set(http_session http,
             enum http_options option, const void *value);
+int  http_options_set_body(http_session http, enum http_options option,
+                           const void *data, size_t len);
+int  http_options_set_body_ref(http_session http, enum http_options option,
+                               const void *data, size_t len);
 int  http_options_get(http_session http, 
             enum http_options option, char **value);
+int  http_header_add(http_session http, const char *name, const char *value);
+int  http_header_set(http_session http, const char *name, const char *value);
+int  http_header_remove(http_session http, const char *name);
 int  http_options_get_request_method(http_session http);
 int  http_options_get_http_version(http_session http);
 int  http_options_get_tls_version(http_session http);
+int  http_get_ktls(http_session http);
 int  http_get_status_code(http_session http);
+int  http_get_response_version(http_session http);
+const char *http_get_reason_phrase(http_session http, size_t *len);
 int  http_get_error_code(http_session http);
 int  http_perform_req(http_session http);
 int  http_proxy_perform_req(http_session http);
+int  http_resume(http_session http);
+int  http_is_paused(http_session http);
+double http_get_ttfb(http_session http);
+long long http_get_content_length(http_session http);
+http_prepared_request http_prepare_request(http_session http);
+int  http_prepared_set_target(http_prepared_request req, const char *path, const char *query);
+int  http_prepared_set_header(http_prepared_request req, const char *name, const char *value);
+int  http_prepared_send(http_session http, http_prepared_request req);
+int  http_session_send_raw(http_session http, const char *request, size_t len);
+void http_prepared_free(http_prepared_request req);
+
+/**
+ * multipart/form-data bodies. Parts are streamed in the order they were
+ * added; filename and type may be NULL (type defaults to application/octet-stream
+ * for files and callbacks, a type containing CR or LF is rejected with EINVAL).
+ * The body has a Content-Length when every part size is known and is sent
+ * chunked otherwise.
+ */
+http_mime http_mime_new(void);
+void http_mime_free(http_mime mime);
+int  http_mime_add_field(http_mime mime, const char *name, const void *value, size_t len);
+int  http_mime_add_file(http_mime mime, const char *name, const char *path,
+                        const char *filename, const char *type);
+int  http_mime_add_fd(http_mime mime, const char *name, int fd,
+                      const char *filename, const char *type);
+int  http_mime_add_callback(http_mime mime, const char *name, http_read_callback read_cb,
+                            void *userdata, long long size, const char *filename, const char *type);
+long long http_mime_size(http_mime mime);
+const char *http_mime_content_type(http_mime mime);
+
 const char *http_get_headers(http_session http);
 const char *http_get_body(http_session http);
+size_t http_get_body_len(http_session http);
+size_t http_get_body_segments(http_session http, struct http_body_segment *segments, size_t max);
+void http_get_upload_stats(http_session http, long long *raw_bytes, long long *wire_bytes);
 const char *http_get_header(http_session http,
                             const char *header_name);
+const char *http_get_header_next(http_session http, const char *header_name, size_t *pos);
 const char *libhttp_get_version(void);
 char *http_url_encode(const char *str, size_t str_len);
 char *http_base64_encode(unsigned char *str, size_t str_len);
@@ -175,6 +341,7 @@ const char *http_get_certificate_issuer(http_session http);
 
 # define HTTP_OK 0      // Success
 # define HTTP_ERROR -1  //Error
+# define HTTP_PAUSED 1  // The write callback paused the response, see http_resume()
 
 // HTTP status codes
 enum http_status_code {
@@ -254,6 +421,13 @@ enum http_status_code {
 # define HTTP_FD_NOT_CONNECTED   0x08   /* socket ends not conncted */
 # define HTTP_PROXY_NO_URL       0x09   /* No proxy URL provided */
 # define HTTP_CERT_VP_FAILED     0x10   /* Failed to verify server certificate */
+# define HTTP_REQUEST_TOO_LARGE  0x11   /* Request doesn't fit in the request buffer */
+# define HTTP_INVALID_HEADER     0x12   /* Invalid request header field */
+# define HTTP_ABORTED_BY_CALLBACK 0x13  /* A user callback aborted the transfer */
+# define HTTP_BODY_SIZE_MISMATCH 0x14   /* Streamed body differs from HTTP_OPTIONS_BODY_SIZE */
+# define HTTP_INVALID_OPTION     0x15   /* The option can't be used with this function */
+# define HTTP_INVALID_RESPONSE   0x16   /* Malformed response from the server */
+# define HTTP_RESPONSE_TOO_LARGE 0x17   /* Response body exceeds HTTP_OPTIONS_MAX_RESPONSE_SIZE */
 
 # ifdef __cplusplus
     }
@@ -3,6 +3,12 @@
 
 #include "libhttp.h"
 #include <string>
+#include <string_view>
+#include <array>
+#include <vector>
+#include <utility>
+#include <functional>
+#include <memory>
 #include <cstdlib>
 #include <cstdio>
 
@@ -25,6 +31,10 @@ public:
         errorMessage = http_get_error(session);     // Retrieves the error message from the C-function
         errorCode = http_get_error_code(session);   // Retrieves the error code     --   -   -
     }
+    /**
+     * @brief For errors found before anything reaches the C library
+    */
+    HTTPException(int code, std::string message) : errorCode(code), errorMessage(std::move(message)) {}
     /**
      * @returns an error code
     */
@@ -79,8 +89,39 @@ public:
         httpSession = http_new();
         setOption(HTTP_OPTIONS_URL, url);
     }
+    /**
+     * @brief Takes ownership of an existing http_session
+     * @param session the session, freed by this object
+    */
+    explicit HTTPSession(http_session session) {
+        httpSession = session;
+    }
+    /**
+     * @brief Takes over the session of other, which is left empty
+    */
+    HTTPSession(HTTPSession &&other) noexcept
+        : httpSession(other.httpSession),
+          bodyWriter(std::move(other.bodyWriter)),
+          headerHandler(std::move(other.headerHandler)) {
+        other.httpSession = nullptr;
+    }
+    HTTPSession &operator=(HTTPSession &&other) noexcept {
+        if (this != &other) {
+            if (httpSession)
+                http_free(httpSession);
+            httpSession = other.httpSession;
+            bodyWriter = std::move(other.bodyWriter);
+            headerHandler = std::move(other.headerHandler);
+            other.httpSession = nullptr;
+        }
+        return *this;
+    }
+    // A copy would free the same http_session twice
+    HTTPSession(const HTTPSession &) = delete;
+    HTTPSession &operator=(const HTTPSession &) = delete;
     ~HTTPSession() {
-        http_free(httpSession);
+        if (httpSession)
+            http_free(httpSession);
     }
     /**
      * @brief sets an option
@@ -112,6 +153,104 @@ public:
         http_throw(http_options_set(httpSession, option, value));
         return_throwable;
     }
+    /**
+     * @brief Sets the POST, PUT or PATCH body, which may contain NUL bytes
+     * @param option HTTP_OPTIONS_POST_BODY, HTTP_OPTIONS_PUT_BODY or HTTP_OPTIONS_PATCH_BODY
+     * @param body the body, copied
+     * @throws HTTPException on error(s)
+    */
+    http_throwable setBody(enum http_options option, std::string_view body) {
+        http_throw(http_options_set_body(httpSession, option, body.data(), body.size()));
+        return_throwable;
+    }
+    /**
+     * @brief Streams the request body from a callback
+     * @param callback called for each piece of the body until it returns 0
+     * @param userdata passed to the callback
+     * @param size body size sent as Content-Length, -1 to send it chunked
+     * @throws HTTPException on error(s)
+    */
+    http_throwable setBodyReader(http_read_callback callback, void *userdata = nullptr, long int size = -1) {
+        http_throw(http_options_set(httpSession, HTTP_OPTIONS_BODY_READ_CALLBACK, reinterpret_cast<void *>(callback)));
+        http_throw(http_options_set(httpSession, HTTP_OPTIONS_BODY_READ_DATA, userdata));
+        http_throw(http_options_set(httpSession, HTTP_OPTIONS_BODY_SIZE, &size));
+        return_throwable;
+    }
+    /**
+     * @brief Streams the response body to a callable instead of keeping it
+     * @param writer called with each piece of the body; returns its size to go on,
+     *   HTTP_WRITE_PAUSE to pause until resume() or HTTP_WRITE_ABORT to abort
+     * @throws HTTPException on error(s)
+    */
+    http_throwable setBodyWriter(std::function<size_t(std::string_view)> writer) {
+        bodyWriter = std::make_unique<std::function<size_t(std::string_view)>>(std::move(writer));
+        http_throw(http_options_set(httpSession, HTTP_OPTIONS_BODY_WRITE_CALLBACK,
+                                    reinterpret_cast<void *>(&HTTPSession::writeBody)));
+        http_throw(http_options_set(httpSession, HTTP_OPTIONS_BODY_WRITE_DATA, bodyWriter.get()));
+        return_throwable;
+    }
+    /**
+     * @brief Calls a callable with the final status once the response headers are in
+     * @param handler returns HTTP_HEADER_CONTINUE to read the body or HTTP_HEADER_ABORT to skip it
+     * @throws HTTPException on error(s)
+    */
+    http_throwable setHeaderHandler(std::function<int(int)> handler) {
+        headerHandler = std::make_unique<std::function<int(int)>>(std::move(handler));
+        http_throw(http_options_set(httpSession, HTTP_OPTIONS_HEADER_CALLBACK,
+                                    reinterpret_cast<void *>(&HTTPSession::onHeaders)));
+        http_throw(http_options_set(httpSession, HTTP_OPTIONS_HEADER_DATA, headerHandler.get()));
+        return_throwable;
+    }
+    /**
+     * @brief Goes on reading a response paused by the body writer
+     * @throws HTTPException on error(s)
+    */
+    http_throwable resume() {
+        http_throw(http_resume(httpSession));
+        return_throwable;
+    }
+    /**
+     * @return whether the body writer paused the last response
+    */
+    bool isPaused() {
+        return http_is_paused(httpSession);
+    }
+    /**
+     * @brief Sends a multipart/form-data body
+     * @param form built with http_mime_new() and http_mime_add_*(), must outlive the requests
+     * @throws HTTPException on error(s)
+    */
+    http_throwable setMime(http_mime form) {
+        http_throw(http_options_set(httpSession, HTTP_OPTIONS_MIME, form));
+        return_throwable;
+    }
+    /**
+     * @brief Adds a request header field, keeping fields with the same name
+     * @param name The header field name
+     * @param value The header field value
+     * @throws HTTPException on error(s)
+    */
+    http_throwable addHeader(const char *name, const char *value) {
+        http_throw(http_header_add(httpSession, name, value));
+        return_throwable;
+    }
+    /**
+     * @brief Sets a request header field, replacing fields with the same name (case insensitive)
+     * @param name The header field name
+     * @param value The header field value
+     * @throws HTTPException on error(s)
+    */
+    http_throwable setHeader(const char *name, const char *value) {
+        http_throw(http_header_set(httpSession, name, value));
+        return_throwable;
+    }
+    /**
+     * @brief Removes every request header field with this name
+     * @return true if a field was removed
+    */
+    bool removeHeader(const char *name) {
+        return http_header_remove(httpSession, name) == HTTP_OK;
+    }
     /**
      * @brief Connects to a HTTP server
      * @throws HTTPException on error(s)
@@ -200,6 +339,24 @@ public:
         http_throw(http_session_start(httpSession));
         return_throwable;
     }
+    /**
+     * @brief Sends a request built with nsh::Request on the connected session.
+     * A request holding an invalid target, host or header field isn't sent
+     * @param request the serialized request
+     * @throws HTTPException on error(s), HTTP_INVALID_HEADER for an invalid request
+    */
+    template <class Request>
+    http_throwable send(const Request &request) {
+        if (!request.error().empty()) {
+# ifndef HTTP_NO_CPP_EXCEPTIONS
+            throw HTTPException(HTTP_INVALID_HEADER, request.error());
+# else
+            return HTTP_ERROR;
+# endif
+        }
+        http_throw(http_session_send_raw(httpSession, request.data(), request.size()));
+        return_throwable;
+    }
     /**
      * @brief This helper function can be used to shorten your code
      * it automatically calls some functions for you.
@@ -261,6 +418,22 @@ public:
         code = http_get_status_code(httpSession);
         return code;
     }
+    /**
+     * @brief Retrieves the reason phrase of the last response
+     * @returns a view into the response headers, valid until the next response
+    */
+    std::string_view getReasonPhrase() {
+        size_t len;
+        const char *reason = http_get_reason_phrase(httpSession, &len);
+        return std::string_view(reason, len);
+    }
+    /**
+     * @brief Retrieves the protocol version of the last response's status line
+     * @returns an http_version, 0 before any response
+    */
+    int getResponseVersion() {
+        return http_get_response_version(httpSession);
+    }
     /**
      * @brief Gets a response header
      * @return HTTP response header
@@ -276,14 +449,73 @@ public:
      * @example getHeader("Set-Cookie") to get the field values of the header Set-Cookie
     */
     std::string getHeader(const char *header_name) {
-        return http_get_header(httpSession, header_name);
+        const char *value = http_get_header(httpSession, header_name);
+        return value ? value : "";
+    }
+    /**
+     * @brief Gets every value of a repeated header field, in the order received
+     * @param header_name The header name, case insensitive
+     * @return views valid until the next response on this session
+     * @example getHeaderValues("Set-Cookie")
+    */
+    std::vector<std::string_view> getHeaderValues(const char *header_name) {
+        std::vector<std::string_view> values;
+        size_t pos = 0;
+        while (const char *value = http_get_header_next(httpSession, header_name, &pos))
+            values.emplace_back(value);
+        return values;
     }
     /**
      * @brief Gets a response body
      * @return HTTP response body
     */
     std::string getBody() {
-        return http_get_body(httpSession);
+        std::string body;
+        body.reserve(http_get_body_len(httpSession));
+        for (std::string_view segment : getBodySegments())
+            body.append(segment);
+        return body;
+    }
+    /**
+     * @brief Gets the response body without copying it, as received
+     * @return views into the session's buffers, valid until the next request
+    */
+    std::vector<std::string_view> getBodySegments() {
+        std::vector<http_body_segment> segments(http_get_body_segments(httpSession, nullptr, 0));
+        http_get_body_segments(httpSession, segments.data(), segments.size());
+        std::vector<std::string_view> views;
+        views.reserve(segments.size());
+        for (const http_body_segment &segment : segments)
+            views.emplace_back(segment.data, segment.len);
+        return views;
+    }
+    /**
+     * @brief Directions of the HTTPS connection handled by kernel TLS
+     * @return HTTP_KTLS_TX and/or HTTP_KTLS_RX, 0 if kTLS isn't active
+    */
+    int getKtls() {
+        return http_get_ktls(httpSession);
+    }
+    /**
+     * @brief Request body bytes of the last request
+     * @return bytes before Content-Encoding and as sent
+    */
+    std::pair<long long, long long> getUploadStats() {
+        long long raw, wire;
+        http_get_upload_stats(httpSession, &raw, &wire);
+        return {raw, wire};
+    }
+    /**
+     * @return seconds from sending the last request to the first response byte, -1 if none came
+    */
+    double getTtfb() {
+        return http_get_ttfb(httpSession);
+    }
+    /**
+     * @return Content-Length of the last response, -1 if it had none
+    */
+    long long getContentLength() {
+        return http_get_content_length(httpSession);
     }
     /**
      * @brief Retrives the HTTPS server's certificate subject name
@@ -314,10 +546,17 @@ public:
      * @brief Copies all options in this class to dest
      * @param dest is the destination of the copy operation
     */
-    void copyOptions(HTTPSession dest) {
+    void copyOptions(HTTPSession &dest) {
 
         http_options_copy(dest.getHttpSession(), httpSession);
     }
+    /**
+     * @brief Clones this session, the options are shared until one of the sessions modifies them
+     * @return an unconnected session without a response
+    */
+    HTTPSession clone() {
+        return HTTPSession(http_clone(httpSession));
+    }
     /**
      * @return the libhttp version 
     */
@@ -399,7 +638,19 @@ public:
         return httpSession;
     }
 private:
+    static size_t writeBody(const char *data, size_t len, void *writer) {
+        return (*static_cast<std::function<size_t(std::string_view)> *>(writer))(std::string_view(data, len));
+    }
+
+    static int onHeaders(http_session, int status, void *handler) {
+        return (*static_cast<std::function<int(int)> *>(handler))(status);
+    }
+
     http_session httpSession;
+    // Heap allocated: the http_session holds their address as the callbacks' userdata,
+    // which stays the same when the unique_ptrs move along with it
+    std::unique_ptr<std::function<size_t(std::string_view)>> bodyWriter;
+    std::unique_ptr<std::function<int(int)>> headerHandler;
 };
 
 /**
@@ -543,6 +794,188 @@ public:
         return http_get_proxy_fd(getHttpSession());
     }
 };
+
+namespace detail {
+
+constexpr std::string_view methodToken(http_requests method) {
+    switch (method) {
+    case HTTP_POST: return "POST";
+    case HTTP_PUT: return "PUT";
+    case HTTP_PATCH: return "PATCH";
+    case HTTP_HEAD: return "HEAD";
+    case HTTP_OPTIONS: return "OPTIONS";
+    case HTTP_DELETE: return "DELETE";
+    case HTTP_TRACE: return "TRACE";
+    default: return "GET";
+    }
+}
+
+constexpr std::string_view versionToken(http_version version) {
+    switch (version) {
+    case HTTP_1_0: return "HTTP/1.0";
+    case HTTP_2: return "HTTP/2";
+    default: return "HTTP/1.1";
+    }
+}
+
+/**
+ * Concatenates string_views with static storage at compile time,
+ * Join<A, B>::value is a view of the joined string
+*/
+template <const std::string_view &...Parts>
+struct Join {
+    static constexpr auto join() {
+        std::array<char, (Parts.size() + ... + 0) + 1> buf{};
+        std::size_t i = 0;
+        for (std::string_view part : {Parts...})
+            for (char c : part)
+                buf[i++] = c;
+        return buf;
+    }
+    static constexpr auto storage = join();
+    static constexpr std::string_view value{storage.data(), storage.size() - 1};
+};
+
+// RFC 9110 tchar
+constexpr bool isTokenChar(char c) {
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') ||
+           std::string_view("!#$%&'*+-.^_`|~").find(c) != std::string_view::npos;
+}
+
+constexpr bool isToken(std::string_view name) {
+    if (name.empty())
+        return false;
+    for (char c : name)
+        if (!isTokenChar(c))
+            return false;
+    return true;
+}
+
+// Values can't break out of their line
+constexpr bool isFieldValue(std::string_view value) {
+    return value.find_first_of("\r\n") == std::string_view::npos;
+}
+
+inline constexpr std::string_view space = " ";
+inline constexpr std::string_view colonSpace = ": ";
+inline constexpr std::string_view hostPrefix = "\r\nHost: ";
+
+template <http_requests Method>
+struct Method_ {
+    static constexpr std::string_view value = methodToken(Method);
+};
+
+template <http_version Version>
+struct Version_ {
+    static constexpr std::string_view value = versionToken(Version);
+};
+
+} // namespace detail
+
+/**
+ * Header names usable as compile time header() parameters,
+ * add your own as `inline constexpr std::string_view` variables
+*/
+namespace header {
+inline constexpr std::string_view Accept = "Accept";
+inline constexpr std::string_view Authorization = "Authorization";
+inline constexpr std::string_view Connection = "Connection";
+inline constexpr std::string_view ContentType = "Content-Type";
+inline constexpr std::string_view Cookie = "Cookie";
+inline constexpr std::string_view UserAgent = "User-Agent";
+} // namespace header
+
+/**
+ * @brief Request builder specialized on the request method and HTTP version.
+ * The constant parts of the request ("GET " and " HTTP/1.1\r\nHost: ",
+ * "Name: " for compile time header names) are baked into static storage
+ * at compile time, only the dynamic values are appended at runtime.
+ * @example
+ *  nsh::Request<HTTP_GET> req{"/items?page=2", "example.com"};
+ *  req.header<nsh::header::Accept>("application/json");
+ *  session.send(req.end());
+*/
+template <http_requests Method, http_version Version = HTTP_1_1>
+class Request {
+public:
+    /** "GET " */
+    static constexpr std::string_view requestLinePrefix =
+        detail::Join<detail::Method_<Method>::value, detail::space>::value;
+    /** " HTTP/1.1\r\nHost: " */
+    static constexpr std::string_view hostPrefix =
+        detail::Join<detail::space, detail::Version_<Version>::value, detail::hostPrefix>::value;
+
+    /**
+     * Invalid input (a target with a space, CR or LF, a header name that
+     * isn't a token, CR or LF in the host or a value) is recorded in error()
+     * and the request is refused by HTTPSession::send.
+     * @param target the request target, e.g. "/path?query"
+     * @param host the Host header value
+    */
+    Request(std::string_view target, std::string_view host) {
+        if (target.empty() || target.find_first_of(" \r\n") != std::string_view::npos)
+            invalid("Invalid request target '", target);
+        else if (!detail::isFieldValue(host))
+            invalid("Invalid header field '", "Host");
+        buffer.reserve(requestLinePrefix.size() + target.size() + hostPrefix.size() + host.size() + 256);
+        buffer.append(requestLinePrefix).append(target);
+        buffer.append(hostPrefix).append(host).append("\r\n");
+    }
+    /**
+     * @brief Appends a header whose name is known at compile time
+    */
+    template <const std::string_view &Name>
+    Request &header(std::string_view value) {
+        static_assert(detail::isToken(Name), "header names are tokens");
+        if (!detail::isFieldValue(value))
+            invalid("Invalid header field '", Name);
+        buffer.append(detail::Join<Name, detail::colonSpace>::value).append(value).append("\r\n");
+        return *this;
+    }
+    /**
+     * @brief Appends a header whose name is only known at runtime
+    */
+    Request &header(std::string_view name, std::string_view value) {
+        if (!detail::isToken(name) || !detail::isFieldValue(value))
+            invalid("Invalid header field '", name);
+        buffer.append(name).append(": ").append(value).append("\r\n");
+        return *this;
+    }
+    /**
+     * @brief Ends the header block, writing Content-Length and the body if there is one
+    */
+    Request &end(std::string_view body = {}) {
+        if (!body.empty() || Method == HTTP_POST || Method == HTTP_PUT || Method == HTTP_PATCH)
+            buffer.append("Content-Length: ").append(std::to_string(body.size())).append("\r\n");
+        buffer.append("\r\n").append(body);
+        return *this;
+    }
+
+    const char *data() const {
+        return buffer.data();
+    }
+    std::size_t size() const {
+        return buffer.size();
+    }
+    const std::string &str() const {
+        return buffer;
+    }
+    /**
+     * @returns why the request is invalid, empty if it can be sent
+    */
+    const std::string &error() const {
+        return errorMessage;
+    }
+private:
+    // Keeps the first error
+    void invalid(std::string_view what, std::string_view part) {
+        if (errorMessage.empty())
+            errorMessage.append(what).append(part.substr(0, 100)).append("'");
+    }
+
+    std::string buffer;
+    std::string errorMessage;
+};
 } // namespace http
 
 # endif /* LIBHTTP_HPP_ */
\ No newline at end of file
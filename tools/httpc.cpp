@@ -29,6 +29,7 @@ struct CmdOptions
 	int responseTimeout{0};
 	int httpVersion{0}; // 0=default, 10=1.0, 11=1.1, 20=2
 	int tlsVersion{0};	// 0=default, 10,11,12,13
+	bool ktls{false};
 	bool failOnHttpError{false};
 };
 
@@ -54,6 +55,7 @@ static void printUsage()
 						<< "      --max-time <SEC>         Response timeout seconds\n"
 						<< "      --http1.0|--http1.1|--http2  Force HTTP version\n"
 						<< "      --tlsv1.0|--tlsv1.1|--tlsv1.2|--tlsv1.3  Force TLS version\n"
+						<< "      --ktls                   Offload TLS records to the kernel when supported\n"
 						<< "      --fail                    Exit non-zero on HTTP >= 400\n"
 						<< std::endl;
 }
@@ -170,6 +172,10 @@ static bool parseArgs(int argc, char **argv, CmdOptions &opt)
 		{
 			opt.httpVersion = 20;
 		}
+		else if (a == "--ktls")
+		{
+			opt.ktls = true;
+		}
 		else if (a == "--tlsv1.0")
 		{
 			opt.tlsVersion = 10;
@@ -243,6 +249,8 @@ static void applyCommonOptions(HTTPSession &s, const CmdOptions &opt)
 		s.setOption(HTTP_OPTIONS_TLS_VERSION, (long int)HTTP_TLS_1_2);
 	else if (opt.tlsVersion == 13)
 		s.setOption(HTTP_OPTIONS_TLS_VERSION, (long int)HTTP_TLS_1_3);
+	if (opt.ktls)
+		s.setOption(HTTP_OPTIONS_KTLS, (long int)HTTP_KTLS_ENABLE);
 	if (opt.responseTimeout > 0)
 		s.setOption(HTTP_OPTIONS_RESPONSE_TIMEOUT, (long int)opt.responseTimeout);
 	if (opt.followRedirects)